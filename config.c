@@ -27,11 +27,12 @@ static uint8_t A = 0;
 static uint8_t B = 1;
 static uint8_t C = 2;
 static uint8_t D = 3;
+static uint8_t V = 4;
 
 //-----------------------------------------------------------------------------
 
 volatile Config* Config_new(void) {
-  return Config_new_with_ports(NULL, NULL, NULL, NULL);
+  return Config_new_with_ports(NULL, NULL, NULL, NULL, NULL);
 }
 
 //-----------------------------------------------------------------------------
@@ -39,7 +40,8 @@ volatile Config* Config_new(void) {
 volatile Config* Config_new_with_ports(uint8_t volatile *a,
                                        uint8_t volatile *b,
                                        uint8_t volatile *c,
-                                       uint8_t volatile *d) {
+                                       uint8_t volatile *d,
+                                       uint8_t volatile *v) {
 
   uint8_t i = 0;
   
@@ -49,6 +51,7 @@ volatile Config* Config_new_with_ports(uint8_t volatile *a,
   self->ports[1] = b;
   self->ports[2] = c;
   self->ports[3] = d;
+  self->ports[4] = v;
 
   self->enabled = false;
   self->timeout = 2*50; 
@@ -57,32 +60,37 @@ volatile Config* Config_new_with_ports(uint8_t volatile *a,
   self->num_controls = 0;
   
   i = 0;
-  self->pins[i++] = Pin_new(self, A, 0);
-  self->pins[i++] = Pin_new(self, A, 1);
-  self->pins[i++] = Pin_new(self, A, 2);
-  self->pins[i++] = Pin_new(self, A, 3);
-  self->pins[i++] = Pin_new(self, A, 4);
-  self->pins[i++] = Pin_new(self, A, 5);
-  self->pins[i++] = Pin_new(self, A, 6);
-  self->pins[i++] = Pin_new(self, A, 7);
-
-  self->pins[i++] = Pin_new(self, C, 7);
-  self->pins[i++] = Pin_new(self, C, 6);
-  self->pins[i++] = Pin_new(self, C, 5);
-  self->pins[i++] = Pin_new(self, C, 4);
-  self->pins[i++] = Pin_new(self, C, 3);
-  self->pins[i++] = Pin_new(self, C, 2);
-  self->pins[i++] = Pin_new(self, C, 1);
-  self->pins[i++] = Pin_new(self, C, 0);
-
-  self->pins[i++] = Pin_new(self, D, 6);
-  self->pins[i++] = Pin_new(self, D, 7);
-  self->pins[i++] = Pin_new(self, B, 1);
-  self->pins[i++] = Pin_new(self, B, 3);
-  self->pins[i++] = Pin_new(self, B, 6);
-  self->pins[i++] = Pin_new(self, B, 7);
-  self->pins[i++] = Pin_new(self, D, 4);
-  self->pins[i++] = Pin_new(self, D, 5);  
+  Pin_init(Config_get_pin(self, i++), self, A, 0);
+  Pin_init(Config_get_pin(self, i++), self, A, 1);
+  Pin_init(Config_get_pin(self, i++), self, A, 2);
+  Pin_init(Config_get_pin(self, i++), self, A, 3);
+  Pin_init(Config_get_pin(self, i++), self, A, 4);
+  Pin_init(Config_get_pin(self, i++), self, A, 5);
+  Pin_init(Config_get_pin(self, i++), self, A, 6);
+  Pin_init(Config_get_pin(self, i++), self, A, 7);
+
+  Pin_init(Config_get_pin(self, i++), self, C, 7);
+  Pin_init(Config_get_pin(self, i++), self, C, 6);
+  Pin_init(Config_get_pin(self, i++), self, C, 5);
+  Pin_init(Config_get_pin(self, i++), self, C, 4);
+  Pin_init(Config_get_pin(self, i++), self, C, 3);
+  Pin_init(Config_get_pin(self, i++), self, C, 2);
+  Pin_init(Config_get_pin(self, i++), self, C, 1);
+  Pin_init(Config_get_pin(self, i++), self, C, 0);
+
+  Pin_init(Config_get_pin(self, i++), self, D, 6);
+  Pin_init(Config_get_pin(self, i++), self, D, 7);
+  Pin_init(Config_get_pin(self, i++), self, B, 1);
+  Pin_init(Config_get_pin(self, i++), self, B, 3);
+  Pin_init(Config_get_pin(self, i++), self, B, 6);
+  Pin_init(Config_get_pin(self, i++), self, B, 7);
+  Pin_init(Config_get_pin(self, i++), self, D, 4);
+  Pin_init(Config_get_pin(self, i++), self, D, 5);  
+
+  // virtual pins, set from the host via USB
+  for(uint8_t k=0; k<NUM_VIRTUAL_PINS; k++) {
+    Pin_init(Config_get_pin(self, i++), self, V, k);
+  }
   
   self->strings = (char**) NULL;
   self->num_strings = 0;
@@ -106,15 +114,17 @@ void Config_free(volatile Config* self) {
   }
   free(self->screens);
 
-  for(uint8_t i=0; i<sizeof(self->pins)/sizeof(Pin*); i++) {
-    Pin_free(self->pins[i]);
+  for(uint8_t i=0; i<self->num_strings; i++) {
+    free(self->strings[i]);
   }
+  free(self->strings);
 
-  for(uint8_t i=0; i<SCREEN_ROWS; i++) {
-    if(self->rows[i] != NULL) {
-      free(self->rows[i]);
-    }
-  }
+#ifndef __AVR__
+  free(self->interned);
+#endif
+
+  // rows only link into the rows owned by the screens
+  free(self->rows);
 
   free((void*)self);
 }
@@ -143,17 +153,79 @@ Screen* Config_add_screen(volatile Config *self, Screen* screen) {
 
 //-----------------------------------------------------------------------------
 
-bool Config_has_string(volatile Config *self, char* string, uint8_t *index) {
+#ifndef __AVR__
+
+// The host looks strings up by content for every write command it
+// parses, so they are interned in an open addressing hash table of
+// indices (0xff marks a free slot). The table only catches up with
+// strings added since the last lookup, so the firmware, which never
+// looks strings up, never allocates it.
+
+static uint32_t Config_hash_string(const char* string) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  
+  while(*string) {
+    hash ^= (uint8_t) *string++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+//-----------------------------------------------------------------------------
+
+static uint8_t* Config_find_string(volatile Config *self, const char* string) {
+  uint16_t mask = self->interned_size-1;
+  uint16_t i = Config_hash_string(string) & mask;
+
+  while(self->interned[i] != 0xff &&
+        strcmp(self->strings[self->interned[i]], string) != 0) {
+    i = (i+1) & mask;
+  }
+  return &self->interned[i];
+}
+
+//-----------------------------------------------------------------------------
 
-  for(uint8_t i=0; i<self->num_strings; i++) {    
-    if(strcmp(self->strings[i], string) == 0) {
-      *index = i;
-      return true;
+static void Config_intern_strings(volatile Config *self) {
+  uint8_t *slot;
+  
+  if(self->interned == NULL || self->num_strings*2 > self->interned_size) {
+    self->interned_size = 64;
+    while(self->interned_size < self->num_strings*2) {
+      self->interned_size *= 2;
     }
+    free(self->interned);
+    self->interned = (uint8_t*) malloc(self->interned_size);
+    memset(self->interned, 0xff, self->interned_size);
+    self->num_interned = 0;
   }
-  return false;
+
+  // The first of several equal strings wins, like a linear search would
+  for(; self->num_interned < self->num_strings; self->num_interned++) {
+    slot = Config_find_string(self, self->strings[self->num_interned]);
+    if(*slot == 0xff) {
+      *slot = self->num_interned;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+bool Config_has_string(volatile Config *self, char* string, uint8_t *index) {
+
+  uint8_t *slot;
+
+  Config_intern_strings(self);
+  
+  if(*(slot = Config_find_string(self, string)) == 0xff) {
+    return false;
+  }
+  *index = *slot;
+  return true;
 }
 
+#endif
+
 //-----------------------------------------------------------------------------
 
 char* Config_add_string(volatile Config *self, char* string) {
@@ -365,6 +437,13 @@ void Screen_free(Screen* self) {
   free(self->samples);  
 
   CommandList_free(self->commands);
+
+  for(uint8_t i=0; i<SCREEN_ROWS; i++) {
+    if(self->rows[i] != NULL) {
+      free(self->rows[i]);
+    }
+  }
+  free(self->rows);
   
   free(self);
 }
@@ -416,6 +495,7 @@ void Sample_free(Sample* self) {
   }
   free(self->pins);
   free(self->command_lists);  
+  free(self);
 };
 
 //-----------------------------------------------------------------------------
@@ -492,19 +572,11 @@ void CommandList_free(CommandList* self) {
 
 //-----------------------------------------------------------------------------
 
-Pin *Pin_new(volatile Config* c, uint8_t port, uint8_t pos) {
-  Pin* self = (Pin*) calloc(1, sizeof(Pin));
+void Pin_init(Pin* self, volatile Config* c, uint8_t port, uint8_t pos) {
   self->port = c->ports[port];
   self->pos = pos;
   self->edge[0] = 1;
   self->edge[1] = 1;
-  return self;
-}
-
-//-----------------------------------------------------------------------------
-
-void Pin_free(Pin* self) {
-  free(self);
 }
 
 //-----------------------------------------------------------------------------
@@ -532,29 +604,47 @@ static void Config_read_timeout(volatile Config* self, FILE* in) {
 static void Config_read_strings(volatile Config* self, FILE* in) {
   uint8_t num_strings = fgetc(in);  
   uint8_t len;
+  uint8_t index;
+  uint8_t skip;
   char * string;
   
   for(uint8_t i=0; i<num_strings; i++) {
     len = fgetc(in);
 
-    string = (char *) calloc(len+1, sizeof(char));
-    fread(string, sizeof(char), len, in);
+    // A zero length introduces a view into a string read before,
+    // given as its index, the offset into it and the length
+    if(len == 0) {
+      index = fgetc(in);
+      skip = fgetc(in);
+      len = fgetc(in);
+
+      string = (char *) calloc(len+1, sizeof(char));
+
+      if(index < self->num_strings && skip <= strlen(self->strings[index])) {
+        strncpy(string, self->strings[index]+skip, len);
+      }
+    }
+    else {
+      string = (char *) calloc(len+1, sizeof(char));
+      fread(string, sizeof(char), len, in);
+    }
     
     Config_add_string(self, string);
+    free(string);
   }
 }
 
 static void Config_read_controls(volatile Config* self, FILE* in) {
   uint8_t len  = fgetc(in);
   for(uint8_t i=0; i<len; i++) {
-    Control_read(Config_add_control(self, Control_new()), in);
+    Control_read(Config_add_control(self, Control_new()), self, in);
   }
 }
 
 static void Config_read_screens(volatile Config* self, FILE* in) {
   uint8_t len  = fgetc(in);
   for(uint8_t i=0; i<len; i++) {
-    Screen_read(Config_add_screen(self, Screen_new()), in);
+    Screen_read(Config_add_screen(self, Screen_new()), self, in);
   }
 }
 
@@ -574,8 +664,8 @@ bool Config_read(volatile Config *self, FILE *in) {
 
 //-----------------------------------------------------------------------------
 
-void Control_read(Control* self, FILE* in) {
-  self->pin = config->pins[fgetc(in)];
+void Control_read(Control* self, volatile Config* config, FILE* in) {
+  self->pin = Config_get_pin(config, fgetc(in));
   self->mode = fgetc(in);
   uint8_t num_screens = fgetc(in);
   for(uint8_t i=0; i<num_screens; i++) {
@@ -585,33 +675,33 @@ void Control_read(Control* self, FILE* in) {
 
 //-----------------------------------------------------------------------------
 
-void Screen_read(Screen* self, FILE* in) {
+void Screen_read(Screen* self, volatile Config* config, FILE* in) {
   self->mode = fgetc(in);
 
-  CommandList_read(self->commands, in);
+  CommandList_read(self->commands, config, in);
 
   uint8_t num_samples = fgetc(in);
   for(uint8_t i=0; i<num_samples; i++) {
-    Sample_read(Screen_add_sample(self, Sample_new(self)), in);
+    Sample_read(Screen_add_sample(self, Sample_new(self)), config, in);
   }
 }
 
 //-----------------------------------------------------------------------------
 
-void CommandList_read(CommandList *self, FILE* in) {
+void CommandList_read(CommandList *self, volatile Config* config, FILE* in) {
   uint8_t num_commands = fgetc(in);
   Command *command;
   
   for(uint8_t i=0; i<num_commands; i++) {
     command = Command_new(self->screen);
-    Command_read(command, in);
+    Command_read(command, config, in);
     CommandList_add_command(self, command);
   }
 }
 
 //-----------------------------------------------------------------------------
 
-void Command_read(Command* self, FILE* in) {
+void Command_read(Command* self, volatile Config* config, FILE* in) {
   self->action = fgetc(in);
   self->row = fgetc(in);
   self->col = fgetc(in);
@@ -625,19 +715,19 @@ void Command_read(Command* self, FILE* in) {
 
 //-----------------------------------------------------------------------------
 
-void Sample_read(Sample* self, FILE* in) {
+void Sample_read(Sample* self, volatile Config* config, FILE* in) {
   uint8_t num_pins = fgetc(in);
   CommandList* commands;
   for(uint8_t i=0; i<num_pins; i++) {
-    Sample_add_pin(self, config->pins[fgetc(in)]);
+    Sample_add_pin(self, Config_get_pin(config, fgetc(in)));
   }
 
-  CommandList_read(self->command_list, in);
+  CommandList_read(self->command_list, config, in);
 
   uint8_t num_command_lists = 1<<(self->num_pins);
   for(uint8_t i=0; i<num_command_lists; i++) {
     commands = CommandList_new(self->screen);
-    CommandList_read(commands, in);
+    CommandList_read(commands, config, in);
     Sample_add_commands(self, commands);
   }
 }
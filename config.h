@@ -36,7 +36,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MODE_NOTIFY 2
 #define MODE_ALWAYS 3
 
-#define NUM_PINS 24
+#define NUM_PINS 32
+#define NUM_VIRTUAL_PINS 8 // the last pins read the virtual port
 
 #define ACTION_NONE  0x00
 #define ACTION_WRITE 0x01
@@ -106,14 +107,20 @@ typedef struct {
 } Screen;
 
 typedef struct {
-  uint8_t volatile *ports[4]; // the actual ports to use
-  Pin *pins[NUM_PINS];        // the available pins
+  uint8_t volatile *ports[5]; // the actual ports to use, last is virtual
+  Pin pins[NUM_PINS];         // the available pins, referenced by index
 
   bool enabled;
   uint8_t timeout;
 
   char **strings;
   uint8_t num_strings;
+
+#ifndef __AVR__
+  uint8_t *interned;       // hash table of indices into strings, host only
+  uint16_t interned_size;
+  uint8_t num_interned;    // strings entered into the table so far
+#endif
   
   Control **controls;
   uint8_t num_controls;
@@ -127,11 +134,16 @@ typedef struct {
 
 volatile Config* config;
 
+static inline Pin* Config_get_pin(volatile Config *self, uint8_t index) {
+  return (Pin*) &self->pins[index];
+}
+
 volatile Config *Config_new(void);
 volatile Config* Config_new_with_ports(uint8_t volatile *a,
                                        uint8_t volatile *b,
                                        uint8_t volatile *c,
-                                       uint8_t volatile *d);
+                                       uint8_t volatile *d,
+                                       uint8_t volatile *v);
 
 Control* Config_add_control(volatile Config *self, Control* control);
 Screen* Config_add_screen(volatile Config *self, Screen* screen);
@@ -148,33 +160,32 @@ void Config_free(volatile Config* self);
 
 Control* Control_new(void);
 void Control_add_screen(Control* self, uint8_t index);
-void Control_read(Control* self, FILE* in);
+void Control_read(Control* self, volatile Config* config, FILE* in);
 void Control_free(Control* self);
 
 Screen* Screen_new(void);
 Screen* Screen_add_control(Screen *self, Control* control);
 Sample* Screen_add_sample(Screen *self, Sample* sample);
-void Screen_read(Screen* self, FILE* in);
+void Screen_read(Screen* self, volatile Config* config, FILE* in);
 void Screen_free(Screen* self);
 
 Sample* Sample_new(Screen* screen);
 Pin* Sample_add_pin(Sample* self, Pin* pin);
-void Sample_read(Sample* self, FILE* in);
+void Sample_read(Sample* self, volatile Config* config, FILE* in);
 CommandList* Sample_add_commands(Sample* self, CommandList* commands);
 void Sample_free(Sample* self);
 
 Command* Command_new(Screen *screen);
 void Command_set_string(Command* self, char *string);
 bool Command_equals(Command* self, Command* command);
-void Command_read(Command* self, FILE* in);
+void Command_read(Command* self, volatile Config* config, FILE* in);
 void Command_free(Command* self);
 
 CommandList* CommandList_new(Screen* screen);
 Command* CommandList_add_command(CommandList *self, Command* command);
-void CommandList_read(CommandList *self, FILE *in);
+void CommandList_read(CommandList *self, volatile Config* config, FILE *in);
 void CommandList_free(CommandList* self);
 
-Pin *Pin_new(volatile Config* config, uint8_t port, uint8_t pos);
-void Pin_free(Pin *self);
+void Pin_init(Pin* self, volatile Config* config, uint8_t port, uint8_t pos);
 
 #endif // CONFIG_H
@@ -0,0 +1,694 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "parser.h"
+#include "usb.h"
+#include "protocol.h"
+#include "emulator.h"
+
+#include "firmware/config.h"
+#include "firmware/live.h"
+#include "firmware/events.h"
+
+#define mstr(s) #s
+#define xstr(s) mstr(s)
+
+// Emulated devices behave like boards running the overlay64 firmware
+// with the USBasp loader. The application side runs the firmware's own
+// config code, compiled for the host, on fake ports. Writes to eeprom
+// and flash take as long as they would on the real chip, and resets
+// take the device off the bus for a while, then bring it back with a
+// new address.
+
+typedef enum { EMULATOR_APPLICATION, EMULATOR_BOOTLOADER } EmulatorMode;
+
+typedef struct {
+  EmulatorMode mode;
+  int address;         // bus address, changes whenever the device resets
+  char port[32];       // stays the same across resets
+  uint64_t reset_at;   // ms, time of a reset requested via usb
+  uint64_t present_at; // ms, time the device is back on the bus
+  uint64_t deadline;   // us, how long the current transfer may take
+
+  uint8_t flash[EMULATOR_FLASH_SIZE];
+  uint8_t eeprom[EMULATOR_EEPROM_SIZE];
+
+  // USBasp loader
+  uint32_t current;    // address of the next byte to read or write
+  uint8_t page[USBASP_PAGE_SIZE];
+
+  // overlay64 firmware
+  uint8_t ports[4];
+  uint8_t inputs;
+  volatile Config *config;
+  uint16_t required;
+  uint8_t status;
+  char version[64];
+  Event events[EVENTS_SIZE];
+  uint8_t head;
+  uint8_t tail;
+  uint8_t dropped;
+  Live live;
+} EmulatedDevice;
+
+typedef struct {
+  EmulatedDevice *device;
+  int address; // handles go stale once the device resets
+} EmulatorHandle;
+
+// Devices keep all of their state to themselves, but resets hand out
+// bus addresses from a shared counter, so all devices share one lock
+
+static pthread_mutex_t emulator_lock = PTHREAD_MUTEX_INITIALIZER;
+static EmulatedDevice *devices = NULL;
+static int num_devices = 0;
+static int next_address = 1;
+
+static void emulator_start(EmulatedDevice *device);
+
+//-----------------------------------------------------------------------------
+// Device state
+//-----------------------------------------------------------------------------
+
+static uint64_t emulator_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//-----------------------------------------------------------------------------
+
+bool emulator_setup(int count) {
+
+  EmulatedDevice *device;
+
+  if(count < 1 || count > EMULATOR_MAX_DEVICES) {
+    fprintf(stderr, "error: can only emulate 1 to %d devices\n", EMULATOR_MAX_DEVICES);
+    return false;
+  }
+
+  if((devices = (EmulatedDevice *) calloc(count, sizeof(EmulatedDevice))) == NULL) {
+    fprintf(stderr, "error: could not allocate emulated devices\n");
+    return false;
+  }
+  num_devices = count;
+
+  for(int i=0; i<num_devices; i++) {
+    device = &devices[i];
+
+    memset(device->flash, 0xff, sizeof(device->flash));
+    memset(device->eeprom, 0xff, sizeof(device->eeprom));
+    memset(device->ports, 0xff, sizeof(device->ports));
+
+    snprintf(device->port, sizeof(device->port), "0-%d", i+1);
+    snprintf(device->version, sizeof(device->version),
+             "overlay64 firmware %s (emulated)", xstr(VERSION));
+
+    device->address = next_address++;
+    emulator_start(device);
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+static volatile Config* emulator_load(EmulatedDevice *device) {
+
+  volatile Config *config;
+  FILE *in;
+
+  config = Config_new_with_ports(&device->ports[0], &device->ports[1],
+                                 &device->ports[2], &device->ports[3],
+                                 &device->inputs);
+
+  if((in = fmemopen(device->eeprom, EEPROM_CONFIG_SIZE, "rb")) == NULL ||
+     !Config_read(config, in)) {
+    Config_install_fallback(config);
+  }
+  if(in != NULL) fclose(in);
+
+  Config_setup(config);
+  Config_apply(config, &device->live);
+  return config;
+}
+
+//-----------------------------------------------------------------------------
+
+static void emulator_start(EmulatedDevice *device) {
+  device->mode = EMULATOR_APPLICATION;
+  device->inputs = 0xff;
+  device->status = OVERLAY64_STATUS_READY;
+  device->head = device->tail = device->dropped = 0;
+  device->config = emulator_load(device);
+}
+
+//-----------------------------------------------------------------------------
+
+static void emulator_reboot(EmulatedDevice *device) {
+
+  // The loader takes over if the application asked for it before
+  // resetting, and clears the request either way
+  bool boot = device->eeprom[0x0ffe] == 0xb0 && device->eeprom[0x0fff] == 0xb0;
+  device->eeprom[0x0ffe] = device->eeprom[0x0fff] = 0xff;
+
+  // Live text only ever lived in RAM
+  if(device->config != NULL) {
+    Live_clear(&device->live, device->config, SCREEN_ROWS);
+    Config_free(device->config);
+    device->config = NULL;
+  }
+
+  device->address = next_address++;
+  device->present_at = device->reset_at + EMULATOR_ENUMERATE_TIME;
+  device->reset_at = 0;
+
+  if(boot) {
+    device->mode = EMULATOR_BOOTLOADER;
+    device->current = 0;
+    memset(device->page, 0xff, sizeof(device->page));
+  }
+  else {
+    emulator_start(device);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+static bool emulator_present(EmulatedDevice *device) {
+
+  uint64_t now = emulator_clock();
+
+  if(device->reset_at && now >= device->reset_at) {
+    emulator_reboot(device);
+  }
+  return now >= device->present_at;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool emulator_matches(EmulatedDevice *device, DeviceInfo *info) {
+
+  if(device->mode == EMULATOR_APPLICATION &&
+     (info->vid != OVERLAY64_VID || info->pid != OVERLAY64_PID)) {
+    return false;
+  }
+
+  if(device->mode == EMULATOR_BOOTLOADER &&
+     (info->vid != USBASP_VID || info->pid != USBASP_PID)) {
+    return false;
+  }
+  return info->port[0] == '\0' || strcmp(info->port, device->port) == 0;
+}
+
+//-----------------------------------------------------------------------------
+
+static EmulatedDevice* emulator_device(DeviceInfo *info) {
+
+  EmulatorHandle *handle = (EmulatorHandle *) info->handle;
+
+  if(!emulator_present(handle->device) ||
+     handle->device->address != handle->address) {
+    return NULL;
+  }
+  return handle->device;
+}
+
+//-----------------------------------------------------------------------------
+
+static void emulator_reset(EmulatedDevice *device) {
+  device->reset_at = emulator_clock() + EMULATOR_RESET_DELAY;
+}
+
+//-----------------------------------------------------------------------------
+
+static void emulator_eeprom(EmulatedDevice *device, uint16_t address, uint8_t value,
+                            bool update, uint64_t *latency) {
+
+  // Like eeprom_update_byte(), unless the loader writes it regardless
+  if(update && device->eeprom[address] == value) {
+    return;
+  }
+  device->eeprom[address] = value;
+  *latency += EMULATOR_EEPROM_LATENCY;
+}
+
+//-----------------------------------------------------------------------------
+// overlay64 firmware
+//-----------------------------------------------------------------------------
+
+static void emulator_loop(EmulatedDevice *device) {
+
+  // One pass through the firmware's main loop: update the screen, then
+  // queue changed lines for the interrupt endpoint
+  uint16_t frame = (emulator_clock() / 20) & 0xffff;
+  Event *event;
+  Pin *pin;
+
+  Config_apply(device->config, &device->live);
+
+  for(uint8_t i=0; i<NUM_PINS; i++) {
+    pin = Config_get_pin(device->config, i);
+
+    if(!Pin_has_changed(pin)) continue;
+
+    if((uint8_t)(device->head - device->tail) == EVENTS_SIZE) {
+      if(device->dropped < 0xff) device->dropped++;
+      continue;
+    }
+
+    event = &device->events[device->head % EVENTS_SIZE];
+    event->frame = frame;
+    event->scanline = 0;
+    event->pin = i;
+    event->level = Pin_state(pin);
+    event->dropped = device->dropped;
+
+    device->dropped = 0;
+    device->head++;
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+static void emulator_reload(EmulatedDevice *device) {
+
+  // Same decision as ReloadConfiguration(), based on what the current
+  // config and the rows of live text on top of it occupy
+  int available = EMULATOR_SRAM_SIZE - EMULATOR_SRAM_STATIC -
+    Config_get_footprint(device->config) - Live_get_footprint(&device->live);
+
+  if(device->required == 0 || device->required + EMULATOR_STACK_RESERVE > available) {
+    device->status = OVERLAY64_STATUS_RESET;
+    emulator_reset(device);
+    return;
+  }
+
+  Config_free(device->config);
+  device->config = emulator_load(device);
+  device->status = OVERLAY64_STATUS_READY;
+}
+
+//-----------------------------------------------------------------------------
+
+static int emulator_flash(EmulatedDevice *device, uint16_t required,
+                          uint8_t *buf, uint16_t size, uint64_t *latency) {
+
+  if(size > EEPROM_CONFIG_SIZE) {
+    device->status = OVERLAY64_STATUS_READY;
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  device->required = required;
+  device->status = OVERLAY64_STATUS_BUSY;
+
+  // The magic goes last, see FlashConfigurationChunk(). Should the host
+  // give up meanwhile, the rest of the config never arrives.
+  for(uint16_t i=0; i<size; i++) {
+    emulator_eeprom(device, i, (i < 2) ? 0xff : buf[i], true, latency);
+    if(*latency > device->deadline) return LIBUSB_ERROR_TIMEOUT;
+  }
+  for(uint16_t i=0; i<2 && i<size; i++) {
+    emulator_eeprom(device, i, buf[i], true, latency);
+  }
+  emulator_eeprom(device, 0x0ffe, 0xff, true, latency);
+  emulator_eeprom(device, 0x0fff, 0xff, true, latency);
+
+  emulator_reload(device);
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+
+static int emulator_patch(EmulatedDevice *device, uint16_t required, uint16_t offset,
+                          uint8_t *buf, uint16_t size, uint64_t *latency) {
+
+  uint8_t magic[2] = { device->eeprom[0], device->eeprom[1] };
+
+  if(offset < sizeof(magic) || size > EEPROM_CONFIG_SIZE - offset) {
+    device->status = OVERLAY64_STATUS_READY;
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  device->required = required;
+  device->status = OVERLAY64_STATUS_BUSY;
+
+  // The magic is cleared meanwhile, see PatchConfigurationChunk()
+  for(uint16_t i=0; i<sizeof(magic); i++) {
+    emulator_eeprom(device, i, 0xff, true, latency);
+  }
+  for(uint16_t i=0; i<size; i++) {
+    emulator_eeprom(device, offset+i, buf[i], true, latency);
+    if(*latency > device->deadline) return LIBUSB_ERROR_TIMEOUT;
+  }
+  for(uint16_t i=0; i<sizeof(magic); i++) {
+    emulator_eeprom(device, i, magic[i], true, latency);
+  }
+
+  emulator_reload(device);
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+
+static int emulator_application(EmulatedDevice *device, uint8_t message,
+                                uint16_t value, uint16_t index,
+                                uint8_t *buf, uint16_t size, uint64_t *latency) {
+  int len;
+
+  switch(message) {
+
+  case OVERLAY64_FLASH:
+    return emulator_flash(device, value, buf, size, latency);
+
+  case OVERLAY64_PATCH:
+    return emulator_patch(device, value, index, buf, size, latency);
+
+  case OVERLAY64_WRITE:
+    Live_begin(&device->live);
+    for(uint16_t i=0; i<size; i++) {
+      Live_receive(&device->live, device->config, buf[i]);
+    }
+    emulator_loop(device);
+    return size;
+
+  case OVERLAY64_BOOT:
+    emulator_eeprom(device, 0x0ffe, 0xb0, true, latency);
+    emulator_eeprom(device, 0x0fff, 0xb0, true, latency);
+    emulator_reset(device);
+    return 0;
+
+  case OVERLAY64_RESET:
+    emulator_eeprom(device, 0x0ffe, 0xff, true, latency);
+    emulator_eeprom(device, 0x0fff, 0xff, true, latency);
+    emulator_reset(device);
+    return 0;
+
+  case OVERLAY64_IDENTIFY:
+    len = strlen(device->version)+1;
+    len = (len < size) ? len : size;
+    memcpy(buf, device->version, len);
+    return len;
+
+  case OVERLAY64_INPUT:
+    device->inputs = (device->inputs & ~(value >> 8)) | (value & (value >> 8));
+    emulator_loop(device);
+    return 0;
+
+  case OVERLAY64_STATUS:
+    if(size < 1) return 0;
+    buf[0] = device->status;
+    if(size < 2) return 1;
+    buf[1] = OVERLAY64_FEATURES;
+    return 2;
+
+  default:
+    break;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// USBasp loader
+//-----------------------------------------------------------------------------
+
+static int emulator_write_flash(EmulatedDevice *device, uint8_t *buf, uint8_t len,
+                                bool last, uint64_t *latency) {
+
+  uint32_t page;
+
+  // Words are collected in the page buffer, which gets written once it
+  // is full or with the last partial page of the transfer
+  for(int i=0; i+1<len; i+=2) {
+
+    if(device->current >= EMULATOR_LOADER_START) {
+      break;
+    }
+
+    device->page[device->current % USBASP_PAGE_SIZE] = buf[i];
+    device->page[(device->current+1) % USBASP_PAGE_SIZE] = buf[i+1];
+    device->current += 2;
+
+    if((device->current % USBASP_PAGE_SIZE) == 0 || (i+2 >= len && last)) {
+      page = (device->current-2) & ~(USBASP_PAGE_SIZE-1);
+
+      memcpy(device->flash + page, device->page, USBASP_PAGE_SIZE);
+      memset(device->page, 0xff, USBASP_PAGE_SIZE);
+      *latency += EMULATOR_PAGE_LATENCY;
+    }
+  }
+  return len;
+}
+
+//-----------------------------------------------------------------------------
+
+static int emulator_bootloader(EmulatedDevice *device, uint8_t message,
+                               uint16_t value, uint16_t index,
+                               uint8_t *buf, uint16_t size, uint64_t *latency) {
+
+  uint8_t len = size & 0xff; // the loader only looks at the low byte
+
+  switch(message) {
+
+  case USBASP_CONNECT:
+    return 0;
+
+  case USBASP_DISCONNECT:
+    // The loader has already cleared the request, so the application
+    // starts on the next reset
+    emulator_reset(device);
+    return 0;
+
+  case USBASP_ENABLEPROG:
+    if(size < 1) return 0;
+    buf[0] = 0;
+    return 1;
+
+  case USBASP_SETLONGADDRESS:
+    device->current = ((uint32_t) index << 16) | value;
+    return 0;
+
+  case USBASP_READFLASH:
+    device->current = (device->current & 0xffff0000) | value;
+    for(int i=0; i<len; i++) {
+      buf[i] = device->flash[device->current++ % EMULATOR_FLASH_SIZE];
+    }
+    return len;
+
+  case USBASP_WRITEFLASH:
+    device->current = (device->current & 0xffff0000) | value;
+    emulator_write_flash(device, buf, len, (index >> 8) & 0x02, latency);
+    return size;
+
+  case USBASP_READEEPROM:
+    for(int i=0; i<len; i++) {
+      buf[i] = device->eeprom[(value+i) % EMULATOR_EEPROM_SIZE];
+    }
+    return len;
+
+  case USBASP_WRITEEEPROM:
+    for(int i=0; i<len; i++) {
+      emulator_eeprom(device, (value+i) % EMULATOR_EEPROM_SIZE, buf[i], false, latency);
+    }
+    return size;
+
+  default:
+    break;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Transport
+//-----------------------------------------------------------------------------
+
+static void emulator_exit(void) {
+  // devices stay around until the process ends, like the real ones
+}
+
+//-----------------------------------------------------------------------------
+
+static int emulator_enumerate(DeviceInfo *match, DeviceInfo *found, int max) {
+
+  DeviceInfo *info;
+  int count = 0;
+
+  pthread_mutex_lock(&emulator_lock);
+
+  for(int i=0; i<num_devices && count < max; i++) {
+
+    if(!emulator_present(&devices[i])) continue;
+    if(!emulator_matches(&devices[i], match)) continue;
+
+    info = &found[count++];
+    memcpy(info, match, sizeof(DeviceInfo));
+
+    info->bus = 0;
+    info->address = devices[i].address;
+    info->serial = NULL;
+    info->handle = NULL;
+    strncpy(info->port, devices[i].port, sizeof(info->port));
+    snprintf(info->path, sizeof(info->path), "%03d/%03d", info->bus, info->address);
+  }
+
+  pthread_mutex_unlock(&emulator_lock);
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool emulator_open(DeviceInfo *info) {
+
+  EmulatorHandle *handle;
+
+  info->handle = NULL;
+
+  pthread_mutex_lock(&emulator_lock);
+
+  for(int i=0; i<num_devices; i++) {
+
+    if(!emulator_present(&devices[i])) continue;
+    if(!emulator_matches(&devices[i], info)) continue;
+
+    handle = (EmulatorHandle *) calloc(1, sizeof(EmulatorHandle));
+    handle->device = &devices[i];
+    handle->address = devices[i].address;
+    info->handle = handle;
+    break;
+  }
+
+  pthread_mutex_unlock(&emulator_lock);
+  return info->handle != NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+static void emulator_close(DeviceInfo *info) {
+  free(info->handle);
+}
+
+//-----------------------------------------------------------------------------
+
+static bool emulator_alive(DeviceInfo *info) {
+
+  bool result;
+
+  pthread_mutex_lock(&emulator_lock);
+  result = emulator_device(info) != NULL;
+  pthread_mutex_unlock(&emulator_lock);
+
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+static int emulator_control(DeviceInfo *info, uint8_t type, uint8_t message,
+                            uint16_t value, uint16_t index,
+                            uint8_t *buf, uint16_t size, unsigned int timeout) {
+
+  EmulatedDevice *device;
+  uint64_t latency = 0;
+  int result;
+
+  pthread_mutex_lock(&emulator_lock);
+
+  if((device = emulator_device(info)) == NULL) {
+    result = LIBUSB_ERROR_NO_DEVICE;
+  }
+  else {
+    // libusb counts 0 as no timeout at all
+    device->deadline = timeout ? timeout*1000ULL : UINT64_MAX;
+
+    result = (device->mode == EMULATOR_APPLICATION) ?
+      emulator_application(device, message, value, index, buf, size, &latency) :
+      emulator_bootloader(device, message, value, index, buf, size, &latency);
+  }
+
+  pthread_mutex_unlock(&emulator_lock);
+
+  // The transfer completes only once the device is done writing, but
+  // other devices carry on meanwhile. Like libusb, give up once the
+  // timeout has passed.
+  if(timeout && latency > timeout*1000ULL) {
+    usleep(timeout*1000ULL);
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  if(latency) {
+    usleep(latency);
+  }
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+static int emulator_interrupt(DeviceInfo *info, uint8_t endpoint,
+                              uint8_t *buf, uint16_t size, unsigned int timeout) {
+
+  EmulatedDevice *device;
+  int result;
+
+  for(unsigned int elapsed=0; ; elapsed+=10) {
+
+    pthread_mutex_lock(&emulator_lock);
+
+    if((device = emulator_device(info)) == NULL) {
+      result = LIBUSB_ERROR_NO_DEVICE;
+    }
+    else if(device->mode != EMULATOR_APPLICATION ||
+            endpoint != OVERLAY64_EVENT_ENDPOINT) {
+      result = LIBUSB_ERROR_PIPE;
+    }
+    else if(device->head != device->tail) {
+      result = (size < sizeof(Event)) ? size : sizeof(Event);
+      memcpy(buf, &device->events[device->tail++ % EVENTS_SIZE], result);
+    }
+    else {
+      result = LIBUSB_ERROR_TIMEOUT;
+    }
+
+    pthread_mutex_unlock(&emulator_lock);
+
+    if(result != LIBUSB_ERROR_TIMEOUT || elapsed >= timeout) {
+      return result;
+    }
+    usleep(10000);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+UsbTransport usb_emulator = {
+  .name      = "emulator",
+  .exit      = emulator_exit,
+  .enumerate = emulator_enumerate,
+  .open      = emulator_open,
+  .close     = emulator_close,
+  .alive     = emulator_alive,
+  .control   = emulator_control,
+  .interrupt = emulator_interrupt,
+};
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,43 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OVERLAY64_EMULATOR_H
+#define OVERLAY64_EMULATOR_H
+
+#include "usb.h"
+#include "heap.h"
+
+#define EMULATOR_MAX_DEVICES 16
+
+#define EMULATOR_FLASH_SIZE   0x20000
+#define EMULATOR_LOADER_START 0x1e000 // protected by the BLB11 lock bit
+#define EMULATOR_EEPROM_SIZE  4096
+#define EMULATOR_SRAM_SIZE    16384
+#define EMULATOR_SRAM_STATIC  (HEAP_STATIC + HEAP_STACK_MAIN) // below and above the heap
+#define EMULATOR_STACK_RESERVE 512    // kept free while reloading the config
+
+#define EMULATOR_EEPROM_LATENCY 3300  // us per eeprom byte written
+#define EMULATOR_PAGE_LATENCY   4500  // us per flash page erased and written
+#define EMULATOR_RESET_DELAY    250   // ms until a requested reset happens
+#define EMULATOR_ENUMERATE_TIME 500   // ms off the bus while resetting
+
+extern UsbTransport usb_emulator;
+
+bool emulator_setup(int count);
+
+#endif // OVERLAY64_EMULATOR_H
@@ -16,13 +16,14 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef __AVR__
 #include <avr/io.h>
+#endif
 
 #include "config.h"
+#include "live.h"
 #include "string.h"
 
-static bool enabled;
-
 //-----------------------------------------------------------------------------
 
 void Config_setup(volatile Config* self) {
@@ -34,7 +35,7 @@ void Config_setup(volatile Config* self) {
 
 void Config_setup_pins(volatile Config* self) {
   for(uint8_t i=0; i<NUM_PINS; i++) {
-    Pin_setup(self->pins[i]);
+    Pin_setup(Config_get_pin(self, i));
   }
 }
 
@@ -42,7 +43,7 @@ void Config_setup_pins(volatile Config* self) {
 
 void Config_sample_pins(volatile Config* self) {
   for(uint8_t i=0; i<NUM_PINS; i++) {
-    Pin_sample(self->pins[i]);
+    Pin_sample(Config_get_pin(self, i));
   }  
 }
 
@@ -59,9 +60,9 @@ void Config_tick(volatile Config* self) {
 
 //-----------------------------------------------------------------------------
 
-void Config_apply(volatile Config* self) {
+void Config_apply(volatile Config* self, Live* live) {
 
-  enabled = false;
+  bool enabled = false;
 
   // Read the state of input and control pins
   Config_sample_pins(self);
@@ -75,7 +76,7 @@ void Config_apply(volatile Config* self) {
   // Determine state of samples and screen state
   for(uint8_t i=0; i<self->num_screens; i++) {    
     Screen* screen = self->screens[i];    
-    Screen_sample(screen);
+    Screen_sample(screen, self);
     
     enabled = enabled || screen->enabled;
   }
@@ -84,7 +85,7 @@ void Config_apply(volatile Config* self) {
   for(uint8_t i=0; i<self->num_screens; i++) {
     Screen* screen = self->screens[i];
     if(!screen->enabled) {
-      Screen_unlink(screen);
+      Screen_unlink(screen, self);
     }
   }
 
@@ -92,11 +93,14 @@ void Config_apply(volatile Config* self) {
   for(uint8_t i=0; i<self->num_screens; i++) {
     Screen* screen = self->screens[i];
     if(screen->enabled) {
-      Screen_write(screen);
-      Screen_link(screen);
+      Screen_render(screen);
+      Screen_link(screen, self);
     }
   }
 
+  // put live text pushed from the host on top of everything
+  enabled = Live_link(live, self) || enabled;
+
   // Apply global enabled value only after it has
   // been fully determined
   self->enabled = enabled;
@@ -112,12 +116,12 @@ void Control_sample(Control* self) {
 
 //-----------------------------------------------------------------------------
 
-void Screen_sample(Screen* self) {
+void Screen_sample(Screen* self, volatile Config* config) {
 
   self->enabled = (self->mode == MODE_ALWAYS);
 
   for(uint8_t i=0; i<self->num_samples; i++) {
-    Sample_sample(self->samples[i], self);    
+    Sample_sample(self->samples[i], self, config);    
   }
 
   for(uint8_t i=0; i<self->num_controls; i++) {
@@ -155,7 +159,7 @@ bool Screen_has_effect(Screen* self) {
 
 //-----------------------------------------------------------------------------
 
-void Screen_notify(Screen* self) {
+void Screen_notify(Screen* self, volatile Config* config) {
   if(self->mode == MODE_NOTIFY) {
     self->timeout = config->timeout;
   }
@@ -163,7 +167,7 @@ void Screen_notify(Screen* self) {
 
 //-----------------------------------------------------------------------------
 
-void Screen_write(Screen* self) {
+void Screen_render(Screen* self) {
   CommandList_execute(self->commands);
 
   for(uint8_t i=0; i<self->num_samples; i++) {
@@ -177,7 +181,7 @@ void Screen_write(Screen* self) {
 
 //-----------------------------------------------------------------------------
 
-void Screen_link(Screen* self) {
+void Screen_link(Screen* self, volatile Config* config) {
   for(uint8_t i=0; i<SCREEN_ROWS; i++) {
     if(self->rows[i] != NULL && config->rows[i] == NULL) {
       config->rows[i] = self->rows[i];
@@ -187,7 +191,7 @@ void Screen_link(Screen* self) {
 
 //-----------------------------------------------------------------------------
 
-void Screen_unlink(Screen* self) {
+void Screen_unlink(Screen* self, volatile Config* config) {
   for(uint8_t i=0; i<SCREEN_ROWS; i++) {
     if(self->rows[i] == config->rows[i]) {
       config->rows[i] = NULL;
@@ -197,7 +201,7 @@ void Screen_unlink(Screen* self) {
 
 //-----------------------------------------------------------------------------
 
-void Sample_sample(Sample* self, Screen* screen) {
+void Sample_sample(Sample* self, Screen* screen, volatile Config* config) {
   Pin *pin;
   self->value = 0;
   
@@ -207,7 +211,7 @@ void Sample_sample(Sample* self, Screen* screen) {
     self->value |= (Pin_state(pin) << i);
     
     if(Pin_has_changed(pin)) {
-      Screen_notify(screen);
+      Screen_notify(screen, config);
     }
   }
 }
@@ -223,6 +227,7 @@ bool Sample_has_effect(Sample* self) {
 //-----------------------------------------------------------------------------
 
 void Pin_setup(Pin* self) {
+#ifdef __AVR__
   uint8_t mask = (1<<(self->pos));
   
   if(self->port == &PINA) {
@@ -244,6 +249,7 @@ void Pin_setup(Pin* self) {
     DDRD &= ~mask;
     PORTD |= mask;
   }
+#endif
 }
 
 //-----------------------------------------------------------------------------
@@ -20,20 +20,21 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define FIRMWARE_CONFIG_H
 
 #include "../config.h"
+#include "live.h"
 
 void Config_setup(volatile Config* self);
 void Config_setup_pins(volatile Config* self);
 void Config_sample_pins(volatile Config* self);
 void Config_tick(volatile Config* self);
-void Config_apply(volatile Config* self);
+void Config_apply(volatile Config* self, Live* live);
 void Control_sample(Control* self);
-void Screen_sample(Screen* self);
+void Screen_sample(Screen* self, volatile Config* config);
 bool Screen_has_effect(Screen* self);
-void Screen_notify(Screen* self);
-void Screen_write(Screen* self);
-void Screen_link(Screen* self);
-void Screen_unlink(Screen* self);
-void Sample_sample(Sample* self, Screen* screen);
+void Screen_notify(Screen* self, volatile Config* config);
+void Screen_render(Screen* self);
+void Screen_link(Screen* self, volatile Config* config);
+void Screen_unlink(Screen* self, volatile Config* config);
+void Sample_sample(Sample* self, Screen* screen, volatile Config* config);
 bool Sample_has_effect(Sample* self);
 void Pin_setup(Pin* self);
 uint8_t Pin_sample(Pin* self);
@@ -19,17 +19,21 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <avr/eeprom.h>
 
-int ReadEeprom(FILE* file) {
+static volatile uint16_t read_addr = 0;
+static volatile uint16_t write_addr = 0;
 
-  static volatile uint16_t addr = 0;
-  return eeprom_read_byte((uint8_t *) (addr++));
+int ReadEeprom(FILE* file) {
+  return eeprom_read_byte((uint8_t *) (read_addr++));
 }
 
 int WriteEeprom(char data, FILE* file) {
-
-  static volatile uint16_t addr = 0;
-  eeprom_update_byte((uint8_t*) (addr++), data);
+  eeprom_update_byte((uint8_t*) (write_addr++), data);
   return 0;
 }
 
+void RewindEeprom(void) {
+  read_addr = 0;
+  write_addr = 0;
+}
+
 FILE eeprom = FDEV_SETUP_STREAM(WriteEeprom, ReadEeprom, _FDEV_SETUP_RW);
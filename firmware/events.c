@@ -0,0 +1,64 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "events.h"
+
+// Events are pushed and popped from the main loop only, so the ring
+// needs no locking and never holds up the video interrupts. When it is
+// full new events are dropped and counted instead.
+
+static Event events[EVENTS_SIZE];
+static uint8_t head = 0;
+static uint8_t tail = 0;
+static uint8_t dropped = 0;
+
+//-----------------------------------------------------------------------------
+
+void Events_push(uint16_t frame, uint16_t scanline, uint8_t pin, uint8_t level) {
+
+  Event* event;
+  
+  if((uint8_t)(head - tail) == EVENTS_SIZE) {
+    if(dropped < 0xff) dropped++;
+    return;
+  }
+
+  event = &events[head % EVENTS_SIZE];
+  event->frame = frame;
+  event->scanline = scanline;
+  event->pin = pin;
+  event->level = level;
+  event->dropped = dropped;
+
+  dropped = 0;
+  head++;
+}
+
+//-----------------------------------------------------------------------------
+
+bool Events_pop(Event* event) {
+
+  if(head == tail) {
+    return false;
+  }
+  *event = events[tail % EVENTS_SIZE];
+  tail++;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
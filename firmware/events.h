@@ -0,0 +1,35 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FIRMWARE_EVENTS_H
+#define FIRMWARE_EVENTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../protocol.h"
+
+// Must be a power of two. At one event per interrupt transfer every
+// 10ms the host drains 100 events/s, so this absorbs a burst of ~0.6s
+// worth of bouncing lines before events are dropped (and counted).
+#define EVENTS_SIZE 64
+
+void Events_push(uint16_t frame, uint16_t scanline, uint8_t pin, uint8_t level);
+bool Events_pop(Event* event);
+
+#endif // FIRMWARE_EVENTS_H
@@ -19,11 +19,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef FONT_H
 #define FONT_H
 
+#ifdef __AVR__
 #include <avr/pgmspace.h>
-
 #define FONT_SECTION __attribute__ ((section(".font")))
+#else
+#include <stdint.h>
+#define FONT_SECTION
+#endif
 
-extern const uint8_t FONT_SECTION _font[96*8];
-uint8_t font[96*8];
+extern const uint8_t FONT_SECTION _font[96*8]; // in flash
+extern uint8_t font[96*8];                     // copied to SRAM
 
 #endif // FONT_H
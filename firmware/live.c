@@ -0,0 +1,166 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+
+#include "live.h"
+
+#define LIVE_ROW  0
+#define LIVE_COL  1
+#define LIVE_LEN  2
+#define LIVE_TEXT 3
+
+// Live text is kept outside of the config, so it survives a config
+// reload and never touches the eeprom. Rows are only allocated once
+// text is written to them.
+
+//-----------------------------------------------------------------------------
+
+void Live_begin(Live* self) {
+  self->state = LIVE_ROW;
+}
+
+//-----------------------------------------------------------------------------
+
+void Live_receive(Live* self, volatile Config* config, uint8_t byte) {
+
+  // Updates are sent as a sequence of (row, col, len, text[len])
+  // records. A record without text removes the live text from the
+  // given row, or from all rows if the row is out of range.
+  
+  switch(self->state) {
+
+  case LIVE_ROW:
+    self->row = byte;
+    self->state = LIVE_COL;
+    break;
+
+  case LIVE_COL:
+    self->col = byte;
+    self->state = LIVE_LEN;
+    break;
+
+  case LIVE_LEN:
+    self->len = byte;
+    
+    if(self->len == 0) {
+      Live_clear(self, config, self->row);
+      self->state = LIVE_ROW;
+    }
+    else {
+      self->state = LIVE_TEXT;
+    }
+    break;
+
+  case LIVE_TEXT:
+    Live_put(self, self->row, self->col++, byte);
+
+    if(--self->len == 0) {
+      self->state = LIVE_ROW;
+    }
+    break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void Live_put(Live* self, uint8_t row, uint8_t col, uint8_t c) {
+
+  LiveRow* live;
+  
+  if(row >= SCREEN_ROWS || col >= SCREEN_COLUMNS) return;
+
+  if((live = self->rows[row]) == NULL) {
+    if((live = (LiveRow*) malloc(sizeof(LiveRow))) == NULL) return;
+
+    for(uint8_t i=0; i<SCREEN_COLUMNS; i++) {
+      live->text[i] = LIVE_TRANSPARENT;
+      live->frame[i] = 0;
+    }
+    self->rows[row] = live;
+  }
+  live->text[col] = (c >= 0x20 && c < 0x80) ? c-0x20 : 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void Live_clear(Live* self, volatile Config* config, uint8_t row) {
+
+  if(row >= SCREEN_ROWS) {
+    for(uint8_t i=0; i<SCREEN_ROWS; i++) {
+      Live_clear(self, config, i);
+    }
+    return;
+  }
+
+  if(self->rows[row] != NULL) {
+    Live_unlink(self, config, row);
+    free(self->rows[row]);
+    self->rows[row] = NULL;
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void Live_unlink(Live* self, volatile Config* config, uint8_t row) {
+  if(self->rows[row] != NULL && config->rows[row] == self->rows[row]->frame) {
+    config->rows[row] = NULL;
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+bool Live_link(Live* self, volatile Config* config) {
+
+  bool active = false;
+  LiveRow* live;
+  uint8_t* below;
+  Screen* screen;
+
+  if(self == NULL) {
+    return false;
+  }
+  
+  for(uint8_t i=0; i<SCREEN_ROWS; i++) {
+    if((live = self->rows[i]) == NULL) continue;
+
+    // Find the row of the first enabled screen underneath...
+    below = NULL;
+    
+    for(uint8_t k=0; k<config->num_screens; k++) {
+      screen = config->screens[k];
+      if(screen->enabled && screen->rows[i] != NULL) {
+        below = screen->rows[i];
+        break;
+      }
+    }
+
+    // ...and put the live text on top of it. Each cell is written
+    // exactly once, so the display never shows an intermediate state.
+    for(uint8_t c=0; c<SCREEN_COLUMNS; c++) {
+      live->frame[c] = (live->text[c] != LIVE_TRANSPARENT) ?
+        live->text[c] : ((below != NULL) ? below[c] : 0);
+    }
+    
+    config->rows[i] = live->frame;
+    active = true;
+  }
+  return active;
+}
+
+//-----------------------------------------------------------------------------
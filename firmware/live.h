@@ -0,0 +1,48 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FIRMWARE_LIVE_H
+#define FIRMWARE_LIVE_H
+
+#include "../config.h"
+
+#define LIVE_TRANSPARENT 0xff
+
+typedef struct {
+  uint8_t text[SCREEN_COLUMNS];  // live text, LIVE_TRANSPARENT where unset
+  uint8_t frame[SCREEN_COLUMNS]; // live text on top of the screen row below
+} LiveRow;
+
+// The live layer of one device, kept apart from its config
+typedef struct {
+  LiveRow* rows[SCREEN_ROWS];
+
+  uint8_t state; // record currently being received
+  uint8_t row;
+  uint8_t col;
+  uint8_t len;
+} Live;
+
+void Live_begin(Live* self);
+void Live_receive(Live* self, volatile Config* config, uint8_t byte);
+void Live_put(Live* self, uint8_t row, uint8_t col, uint8_t c);
+void Live_clear(Live* self, volatile Config* config, uint8_t row);
+void Live_unlink(Live* self, volatile Config* config, uint8_t row);
+bool Live_link(Live* self, volatile Config* config);
+
+#endif // FIRMWARE_LIVE_H
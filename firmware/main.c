@@ -21,6 +21,7 @@
 #include <avr/wdt.h>
 #include <avr/interrupt.h>
 #include <avr/eeprom.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +31,8 @@
 #include "font.h"
 #include "eeprom.h"
 #include "config.h"
+#include "live.h"
+#include "events.h"
 #include "usbdrv/usbdrv.h"
 #include "../protocol.h"
 
@@ -39,18 +42,32 @@
 #define ENABLE_SPI  DDRB |= MOSI  // Enable the SPI output pin
 #define DISABLE_SPI DDRB &= ~MOSI // Disable (tristate) the SPI output pin
 
+#define STACK_RESERVE 512 // SRAM to keep free for the stack during reload
+
 volatile uint16_t scanline; // current scanline of the whole video frame
+volatile uint16_t frame;    // number of frames since startup
 
 volatile Config* config;    // Configuration is read from eeprom
+static volatile Config* pending = NULL; // New config waiting for VSYNC
 
-static volatile bool reset = false; // Requests a reset from USB
+static volatile bool reset = false;  // Requests a reset from USB
+static volatile bool reload = false; // Requests a config reload from USB
+static volatile uint16_t required;   // SRAM required by the new config
+static volatile uint8_t status = OVERLAY64_STATUS_READY;
 static volatile char version[64];   // Version string
 
+uint8_t font[96*8]; // Font data, read from SRAM while bitbanging
+
+static volatile uint8_t inputs = 0xff; // Virtual input lines set from USB
+static Live live;                      // Text written over USB
+
 static volatile uint8_t usbCommand;
 static volatile uint16_t usbDataReceived;
 static volatile uint16_t usbDataLength;
-static volatile uint8_t *usbData;
-static volatile uint16_t usbDataPos;
+static volatile uint16_t usbDataOffset; // where a patch goes in eeprom
+
+static uint8_t magic[2]; // Config magic, held back until upload is complete
+static uchar reply[2];   // Status and features
 
 //-----------------------------------------------------------------------------
 
@@ -64,7 +81,7 @@ static void setup() {
   SetupFont();
   
   // Create config and assign ports
-  config = Config_new_with_ports(&PINA, &PINB, &PINC, &PIND);
+  config = Config_new_with_ports(&PINA, &PINB, &PINC, &PIND, &inputs);
 
   // Read config from eeprom
   Config_read(config, &eeprom) || Config_install_fallback(config);
@@ -123,15 +140,25 @@ void DisableDisplay(void) {
   PCICR = 0; 
 }
 
+
 //-----------------------------------------------------------------------------
 
 ISR(INT1_vect, ISR_NOBLOCK) { // VSYNC (each frame)...
+
+  // Swap in a newly loaded config before the next frame starts
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if(pending != NULL) {
+      config = pending;
+      pending = NULL;
+    }
+  }
   
   // Decrease timeout counters for all screens
   Config_tick(config);
    
   // Reset scanline counter
   scanline = 0;
+  frame++;
 }
 
 //-----------------------------------------------------------------------------
@@ -268,15 +295,31 @@ USB_PUBLIC usbMsgLen_t usbFunctionSetup(uint8_t data[8]) {
   switch(usbRequest->bRequest) {
 
   case OVERLAY64_FLASH:
-    DisableDisplay();
+    usbCommand = usbRequest->bRequest;
+    usbDataLength = usbRequest->wLength.word;
+    usbDataReceived = 0;
+    required = usbRequest->wValue.word;
+    status = OVERLAY64_STATUS_BUSY;
     
+    return USB_NO_MSG;
+    break;
+
+  case OVERLAY64_PATCH:
     usbCommand = usbRequest->bRequest;
     usbDataLength = usbRequest->wLength.word;
     usbDataReceived = 0;
+    usbDataOffset = usbRequest->wIndex.word;
+    required = usbRequest->wValue.word;
+    status = OVERLAY64_STATUS_BUSY;
     
-    if(usbData == NULL) {
-      usbData = (uint8_t*) calloc(1, sizeof(uint8_t) * usbDataLength);
-    }
+    return USB_NO_MSG;
+    break;
+
+  case OVERLAY64_WRITE:
+    usbCommand = usbRequest->bRequest;
+    usbDataLength = usbRequest->wLength.word;
+    usbDataReceived = 0;
+    Live_begin(&live);
     
     return USB_NO_MSG;
     break;
@@ -295,6 +338,20 @@ USB_PUBLIC usbMsgLen_t usbFunctionSetup(uint8_t data[8]) {
     usbMsgPtr = (uchar *) version;
     return strlen((const char*)version)+1;
     break;
+
+  case OVERLAY64_INPUT:
+    // wValue holds the new line states in its low byte and a mask of
+    // the lines to change in its high byte
+    inputs = (inputs & ~usbRequest->wValue.bytes[1]) |
+      (usbRequest->wValue.bytes[0] & usbRequest->wValue.bytes[1]);
+    break;
+    
+  case OVERLAY64_STATUS:
+    reply[0] = status;
+    reply[1] = OVERLAY64_FEATURES;
+    usbMsgPtr = reply;
+    return sizeof(reply);
+    break;
     
   default:
     break;
@@ -306,30 +363,188 @@ USB_PUBLIC usbMsgLen_t usbFunctionSetup(uint8_t data[8]) {
 
 USB_PUBLIC uchar usbFunctionWrite(uchar *data, uchar len) {
 
-  for(int i=0; usbDataReceived < usbDataLength && i < len; i++, usbDataReceived++) {
-    usbData[usbDataReceived] = (uint8_t) data[i];
+  if(usbCommand == OVERLAY64_FLASH) {
+    return FlashConfigurationChunk(data, len);
   }
 
+  if(usbCommand == OVERLAY64_PATCH) {
+    return PatchConfigurationChunk(data, len);
+  }
+
+  if(usbCommand == OVERLAY64_WRITE) {
+    for(uint8_t i=0; i<len && usbDataReceived < usbDataLength; i++, usbDataReceived++) {
+      Live_receive(&live, config, data[i]);
+    }
+    return usbDataReceived == usbDataLength;
+  }
+  return 0xff;
+}
+
+//-----------------------------------------------------------------------------
+
+uint8_t FlashConfigurationChunk(uint8_t *data, uint8_t len) {
+
+  uint16_t addr = usbDataReceived;
+
+  // Refuse configs that would overwrite the bootloader flag
+  if(usbDataLength > EEPROM_CONFIG_SIZE) {
+    status = OVERLAY64_STATUS_READY;
+    return 0xff;
+  }
+
+  if(len > usbDataLength - addr) {
+    len = usbDataLength - addr;
+  }
+
+  // Each chunk is committed to eeprom as soon as it arrives. V-USB
+  // NAKs further data while we're busy writing, so the host is
+  // throttled to the eeprom write speed. The magic is written last,
+  // so that an interrupted upload never leaves a config behind that
+  // looks valid.
+  for(uint8_t i=0; i<len && addr+i < sizeof(magic); i++) {
+    magic[addr+i] = data[i];
+    data[i] = 0xff;
+  }
+  
+  eeprom_update_block(data, (void *) addr, len);
+  usbDataReceived += len;
+  
   if(usbDataReceived < usbDataLength) {
     return 0;
   }
-  else {
-    if(usbCommand == OVERLAY64_FLASH) {
-      FlashConfigurationFromUSBData();
-    }
+
+  eeprom_update_block(magic, (void *) 0, sizeof(magic));
+  eeprom_update_word((uint16_t *)0x0ffe, (uint16_t) 0xffff);
+  reload = true;
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+
+uint8_t PatchConfigurationChunk(uint8_t *data, uint8_t len) {
+
+  uint16_t addr = usbDataOffset + usbDataReceived;
+
+  // Patches never touch the magic and never reach the bootloader flag
+  if(usbDataOffset < sizeof(magic) ||
+     usbDataLength > EEPROM_CONFIG_SIZE - usbDataOffset) {
+    status = OVERLAY64_STATUS_READY;
+    return 0xff;
+  }
+
+  if(len > usbDataLength - usbDataReceived) {
+    len = usbDataLength - usbDataReceived;
   }
+
+  // The magic is cleared while the patch is written, just like a full
+  // upload, so that an interrupted patch doesn't leave a mix of the
+  // old and the new config behind that looks valid.
+  if(usbDataReceived == 0) {
+    eeprom_read_block(magic, (void *) 0, sizeof(magic));
+    eeprom_update_word((uint16_t *) 0, (uint16_t) 0xffff);
+  }
+  
+  eeprom_update_block(data, (void *) addr, len);
+  usbDataReceived += len;
   
-  free((void*)usbData);
-  usbData = NULL;
+  if(usbDataReceived < usbDataLength) {
+    return 0;
+  }
+
+  eeprom_update_block(magic, (void *) 0, sizeof(magic));
+  reload = true;
   return 1;
 }
 
 //-----------------------------------------------------------------------------
 
-void FlashConfigurationFromUSBData(void) {  
-  fwrite((void*)usbData, sizeof(uint8_t), usbDataLength, &eeprom);
-  eeprom_update_word((uint16_t *)0x0ffe, (uint16_t) 0xffff);
-  reset = true;
+uint16_t FreeMemory(void) {
+  extern char __heap_start;
+  extern char *__brkval;
+  char top;
+  
+  return (uint16_t) (&top - (__brkval == NULL ? &__heap_start : __brkval));
+}
+
+//-----------------------------------------------------------------------------
+
+void ReloadConfiguration(void) {
+
+  volatile Config* previous = config;
+  volatile Config* next;
+
+  // The new config is built while the current one is still displayed,
+  // so both have to fit into SRAM at the same time. If the host did
+  // not tell us how much is required, or if there isn't enough left,
+  // fall back to resetting the device.
+  if(required == 0 || required + STACK_RESERVE > FreeMemory()) {
+    status = OVERLAY64_STATUS_RESET;
+    reset = true;
+    return;
+  }
+
+  // Read new config from eeprom and precalculate its first frame
+  next = Config_new_with_ports(&PINA, &PINB, &PINC, &PIND, &inputs);
+
+  RewindEeprom();
+  Config_read(next, &eeprom) || Config_install_fallback(next);
+
+  Config_setup(next);
+  Config_apply(next, &live);
+  
+  // Hand it over to the VSYNC interrupt...
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    pending = next;
+  }
+
+  // ...and wait for the swap, but don't wait forever in case there
+  // is no video signal. USB isn't polled meanwhile, so nothing else
+  // gets to touch either config before the old one is freed.
+  for(uint8_t i=0; pending != NULL && i<40; i++) {
+    _delay_ms(1);
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if(pending != NULL) {
+      config = pending;
+      pending = NULL;
+    }
+  }
+
+  Config_free(previous);
+
+  status = OVERLAY64_STATUS_READY;
+}
+
+//-----------------------------------------------------------------------------
+
+void QueuePinChanges(void) {
+
+  uint16_t f, s;
+  Pin* pin;
+  
+  for(uint8_t i=0; i<NUM_PINS; i++) {
+    pin = Config_get_pin(config, i);
+    
+    if(Pin_has_changed(pin)) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        f = frame;
+        s = scanline;
+      }
+      Events_push(f, s, i, Pin_state(pin));
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void SendPinChanges(void) {
+
+  static Event event;
+
+  if(usbInterruptIsReady() && Events_pop(&event)) {
+    usbSetInterrupt((uchar *) &event, sizeof(Event));
+  }
 }
 
 //-----------------------------------------------------------------------------
@@ -356,9 +571,19 @@ int main(void) {
       _delay_ms(250);
       Reset();
     }
+
+    // If a new config has been flashed, load it without resetting
+    if(reload) {
+      reload = false;
+      ReloadConfiguration();
+    }
     
     // Sample input/control lines and update screen according to user config
-    Config_apply(config);
+    Config_apply(config, &live);
+
+    // Report changed lines to the host
+    QueuePinChanges();
+    SendPinChanges();
   }
   
   return 0;    
@@ -37,6 +37,12 @@ void CheckBootloader(void);
 void EnterBootloader(void);
 void SetupFont(void);
 void SetupVersionString(void);
-void FlashConfigurationFromUSBData(void);
+void DisableDisplay(void);
+uint8_t FlashConfigurationChunk(uint8_t *data, uint8_t len);
+uint8_t PatchConfigurationChunk(uint8_t *data, uint8_t len);
+uint16_t FreeMemory(void);
+void ReloadConfiguration(void);
+void QueuePinChanges(void);
+void SendPinChanges(void);
 
 #endif // MAIN_H
@@ -0,0 +1,555 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "parser.h"
+
+// Sizes of the config structures as laid out by avr-gcc, with 2 byte
+// pointers and without any padding
+#define AVR_POINTER      2
+#define AVR_CONFIG       (5*AVR_POINTER + NUM_PINS*5 + 1+1 + AVR_POINTER+1 + \
+                          AVR_POINTER+1 + AVR_POINTER+1 + AVR_POINTER)
+#define AVR_SCREEN       (1+1+1 + AVR_POINTER+1 + AVR_POINTER+1 + AVR_POINTER + AVR_POINTER)
+#define AVR_SAMPLE       (AVR_POINTER + AVR_POINTER+1 + 1 + AVR_POINTER + AVR_POINTER+1)
+#define AVR_COMMAND_LIST (AVR_POINTER + AVR_POINTER+1)
+#define AVR_COMMAND      (AVR_POINTER + 1+1+1+2 + AVR_POINTER)
+#define AVR_LIVE_ROW     (2*SCREEN_COLUMNS)
+
+// Like struct __freelist, a chunk is its size followed by the memory
+// handed out, which holds the pointer to the next chunk while free
+#define HEADER 2
+#define SIZE(chunk) (chunk)
+#define NEXT(chunk) ((chunk)+HEADER)
+#define FREELIST_ENTRY 4
+
+//-----------------------------------------------------------------------------
+
+static uint16_t Heap_get(Heap* self, uint16_t addr) {
+  return self->ram[addr] | (self->ram[addr+1] << 8);
+}
+
+//-----------------------------------------------------------------------------
+
+static void Heap_set(Heap* self, uint16_t addr, uint16_t value) {
+  self->ram[addr] = value & 0xff;
+  self->ram[addr+1] = value >> 8;
+}
+
+//-----------------------------------------------------------------------------
+
+static uint16_t Heap_extend(Heap* self, uint16_t brkval) {
+  self->brkval = brkval;
+  if(brkval > self->peak) {
+    self->peak = brkval;
+  }
+  return brkval;
+}
+
+//-----------------------------------------------------------------------------
+
+Heap* Heap_new(uint16_t start, uint16_t limit) {
+  Heap* self = (Heap*) calloc(1, sizeof(Heap));
+  self->flp = 0;
+  self->brkval = start;
+  self->start = start;
+  self->limit = limit;
+  self->peak = start;
+  self->failed = false;
+  return self;
+}
+
+//-----------------------------------------------------------------------------
+// The following mirror avr-libc's malloc(), free() and realloc() step
+// by step, so that chunks are placed and split exactly as on the device
+//-----------------------------------------------------------------------------
+
+uint16_t Heap_malloc(Heap* self, uint16_t len) {
+  uint16_t fp1, fp2, sfp1 = 0, sfp2 = 0;
+  uint16_t s, cp, avail;
+
+  if(len < FREELIST_ENTRY - HEADER) {
+    len = FREELIST_ENTRY - HEADER;
+  }
+
+  // An exact fit, or else the smallest chunk that is large enough
+  for(s = 0, fp1 = self->flp, fp2 = 0; fp1; fp2 = fp1, fp1 = Heap_get(self, NEXT(fp1))) {
+    if(Heap_get(self, SIZE(fp1)) < len) {
+      continue;
+    }
+    if(Heap_get(self, SIZE(fp1)) == len) {
+      if(fp2) Heap_set(self, NEXT(fp2), Heap_get(self, NEXT(fp1)));
+      else self->flp = Heap_get(self, NEXT(fp1));
+      return NEXT(fp1);
+    }
+    if(s == 0 || Heap_get(self, SIZE(fp1)) < s) {
+      s = Heap_get(self, SIZE(fp1));
+      sfp1 = fp1;
+      sfp2 = fp2;
+    }
+  }
+
+  if(s) {
+    // Too small to split off a free chunk, hand out all of it...
+    if(s - len < FREELIST_ENTRY) {
+      if(sfp2) Heap_set(self, NEXT(sfp2), Heap_get(self, NEXT(sfp1)));
+      else self->flp = Heap_get(self, NEXT(sfp1));
+      return NEXT(sfp1);
+    }
+    // ...otherwise hand out its upper end
+    s -= len;
+    cp = sfp1 + s;
+    Heap_set(self, SIZE(cp), len);
+    Heap_set(self, SIZE(sfp1), s - HEADER);
+    return NEXT(cp);
+  }
+
+  // Nothing on the freelist, so the heap grows towards the stack
+  cp = self->limit;
+  if(cp <= self->brkval) {
+    goto error;
+  }
+  avail = cp - self->brkval;
+
+  if(avail >= len && avail >= len + HEADER) {
+    fp1 = self->brkval;
+    Heap_extend(self, self->brkval + len + HEADER);
+    Heap_set(self, SIZE(fp1), len);
+    return NEXT(fp1);
+  }
+
+ error:
+  self->failed = true;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+uint16_t Heap_calloc(Heap* self, uint16_t count, uint16_t size) {
+  return Heap_malloc(self, count * size);
+}
+
+//-----------------------------------------------------------------------------
+
+void Heap_release(Heap* self, uint16_t ptr) {
+  uint16_t fp1, fp2, fpnew, cp2;
+
+  if(ptr == 0) {
+    return;
+  }
+  fpnew = ptr - HEADER;
+  Heap_set(self, NEXT(fpnew), 0);
+
+  // The first free chunk either lowers the top of the heap or starts
+  // the freelist
+  if(self->flp == 0) {
+    if(ptr + Heap_get(self, SIZE(fpnew)) == self->brkval) {
+      self->brkval = fpnew;
+    }
+    else {
+      self->flp = fpnew;
+    }
+    return;
+  }
+
+  for(fp1 = self->flp, fp2 = 0; fp1 != 0 && fp1 < fpnew;
+      fp2 = fp1, fp1 = Heap_get(self, NEXT(fp1)));
+
+  // Join the chunk above...
+  Heap_set(self, NEXT(fpnew), fp1);
+  if(NEXT(fpnew) + Heap_get(self, SIZE(fpnew)) == fp1) {
+    Heap_set(self, SIZE(fpnew),
+             Heap_get(self, SIZE(fpnew)) + Heap_get(self, SIZE(fp1)) + HEADER);
+    Heap_set(self, NEXT(fpnew), Heap_get(self, NEXT(fp1)));
+  }
+
+  if(fp2 == 0) {
+    self->flp = fpnew;
+    return;
+  }
+
+  // ...and the one below
+  Heap_set(self, NEXT(fp2), fpnew);
+  if(NEXT(fp2) + Heap_get(self, SIZE(fp2)) == fpnew) {
+    Heap_set(self, SIZE(fp2),
+             Heap_get(self, SIZE(fp2)) + Heap_get(self, SIZE(fpnew)) + HEADER);
+    Heap_set(self, NEXT(fp2), Heap_get(self, NEXT(fpnew)));
+  }
+
+  // A free chunk at the top of the heap lowers it instead
+  for(fp1 = self->flp, fp2 = 0; Heap_get(self, NEXT(fp1)) != 0;
+      fp2 = fp1, fp1 = Heap_get(self, NEXT(fp1)));
+
+  cp2 = NEXT(fp1);
+  if(cp2 + Heap_get(self, SIZE(fp1)) == self->brkval) {
+    if(fp2 == 0) self->flp = 0;
+    else Heap_set(self, NEXT(fp2), 0);
+    self->brkval = fp1;
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+uint16_t Heap_realloc(Heap* self, uint16_t ptr, uint16_t len) {
+  uint16_t fp1, fp2, fp3, ofp3;
+  uint16_t s, incr, size, memp;
+
+  if(ptr == 0) {
+    return Heap_malloc(self, len);
+  }
+  fp1 = ptr - HEADER;
+  size = Heap_get(self, SIZE(fp1));
+
+  // Shrinking frees the rest, unless it's too small for the freelist
+  if(len <= size) {
+    if(size <= FREELIST_ENTRY || len > size - FREELIST_ENTRY) {
+      return ptr;
+    }
+    fp2 = ptr + len;
+    Heap_set(self, SIZE(fp2), size - len - HEADER);
+    Heap_set(self, SIZE(fp1), len);
+    Heap_release(self, NEXT(fp2));
+    return ptr;
+  }
+
+  // Growing takes over a free chunk right above, if large enough...
+  incr = len - size;
+  fp2 = ptr + size;
+
+  for(s = 0, ofp3 = 0, fp3 = self->flp; fp3; ofp3 = fp3, fp3 = Heap_get(self, NEXT(fp3))) {
+    if(fp3 == fp2 && Heap_get(self, SIZE(fp3)) + HEADER >= incr) {
+      if(Heap_get(self, SIZE(fp3)) + HEADER - incr > FREELIST_ENTRY) {
+        fp2 = ptr + len;
+        Heap_set(self, NEXT(fp2), Heap_get(self, NEXT(fp3)));
+        Heap_set(self, SIZE(fp2), Heap_get(self, SIZE(fp3)) - incr);
+      }
+      else {
+        incr = Heap_get(self, SIZE(fp3)) + HEADER;
+        fp2 = Heap_get(self, NEXT(fp3));
+      }
+      if(ofp3) Heap_set(self, NEXT(ofp3), fp2);
+      else self->flp = fp2;
+
+      Heap_set(self, SIZE(fp1), size + incr);
+      return ptr;
+    }
+    if(Heap_get(self, SIZE(fp3)) > s) {
+      s = Heap_get(self, SIZE(fp3));
+    }
+  }
+
+  // ...or extends the heap if it's the topmost chunk, unless a chunk
+  // on the freelist would do...
+  if(self->brkval == ptr + size && len > s) {
+    if(ptr + len < self->limit) {
+      Heap_extend(self, ptr + len);
+      Heap_set(self, SIZE(fp1), len);
+      return ptr;
+    }
+    self->failed = true;
+    return 0;
+  }
+
+  // ...or else moves it somewhere else entirely
+  if((memp = Heap_malloc(self, len)) == 0) {
+    return 0;
+  }
+  Heap_release(self, ptr);
+  return memp;
+}
+
+//-----------------------------------------------------------------------------
+
+void Heap_free(Heap* self) {
+  free(self);
+}
+
+//-----------------------------------------------------------------------------
+// Replays what Config_new() and Config_read() allocate on the device,
+// reading the same binary in the same order
+//-----------------------------------------------------------------------------
+
+typedef struct {
+  uint16_t controls;         // the screen's control pointers
+  uint8_t rows[SCREEN_ROWS]; // rows in the order commands first use them
+  uint8_t num_rows;
+  uint8_t num_controls;
+} ScreenReplay;
+
+//-----------------------------------------------------------------------------
+
+static void ScreenReplay_use_row(ScreenReplay* self, uint8_t row) {
+  if(row >= SCREEN_ROWS || memchr(self->rows, row, self->num_rows) != NULL) {
+    return;
+  }
+  self->rows[self->num_rows++] = row;
+}
+
+//-----------------------------------------------------------------------------
+
+static uint16_t Heap_new_command_list(Heap* self, uint16_t *commands) {
+  uint16_t list = Heap_calloc(self, 1, AVR_COMMAND_LIST);
+  *commands = Heap_calloc(self, 1, AVR_POINTER);
+  return list;
+}
+
+//-----------------------------------------------------------------------------
+
+static void Heap_read_command_list(Heap* self, uint16_t commands,
+                                   ScreenReplay* screen, FILE* in) {
+  uint8_t num_commands = fgetc(in);
+  uint8_t command[5];
+
+  for(uint8_t i=0; i<num_commands; i++) {
+    Heap_calloc(self, 1, AVR_COMMAND);
+    fread(command, sizeof(uint8_t), sizeof(command), in);
+    ScreenReplay_use_row(screen, command[1]);
+    commands = Heap_realloc(self, commands, (i+1)*AVR_POINTER);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+static void Heap_read_strings(Heap* self, uint16_t* strings, FILE* in) {
+  uint8_t num_strings = fgetc(in);
+  uint8_t lengths[256];
+  char buffer[256];
+  uint8_t len, index, skip, actual;
+  uint16_t string;
+
+  for(uint16_t i=0; i<num_strings; i++) {
+    len = fgetc(in);
+
+    if(len == 0) {
+      index = fgetc(in);
+      skip = fgetc(in);
+      len = fgetc(in);
+      actual = 0;
+
+      if(index < i && skip <= lengths[index]) {
+        actual = (lengths[index] - skip < len) ? lengths[index] - skip : len;
+      }
+    }
+    else {
+      memset(buffer, 0, sizeof(buffer));
+      fread(buffer, sizeof(char), len, in);
+      actual = strlen(buffer);
+    }
+    lengths[i] = actual;
+
+    // read into a temporary buffer, then copied by Config_add_string()
+    string = Heap_calloc(self, len+1, 1);
+    *strings = Heap_realloc(self, *strings, (i+1)*AVR_POINTER);
+    Heap_calloc(self, actual+1, 1);
+    Heap_release(self, string);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+static bool Heap_read_config(Heap* self, FILE* in) {
+  uint16_t controls, screens = 0, strings = 0;
+  uint16_t commands, pins, lists, samples;
+  uint8_t num_controls, num_screens, num_samples, num_pins, num_screen_indices;
+  ScreenReplay *replays = NULL;
+  long assignments;
+  uint8_t index;
+  bool result = false;
+
+  // Config_new()
+  Heap_calloc(self, 1, AVR_CONFIG);
+  controls = Heap_calloc(self, 1, AVR_POINTER);
+  Heap_calloc(self, SCREEN_ROWS, AVR_POINTER);
+
+  if(fgetc(in) != CONFIG_MAGIC[0] || fgetc(in) != CONFIG_MAGIC[1]) {
+    goto done;
+  }
+  fgetc(in); // timeout
+
+  Heap_read_strings(self, &strings, in);
+
+  // Controls are assigned to screens once these are read, so
+  // remember where their screen indices are
+  assignments = ftell(in);
+  num_controls = fgetc(in);
+
+  for(uint16_t i=0; i<num_controls; i++) {
+    Heap_calloc(self, 1, AVR_SAMPLE); // Control_new() allocates a Sample
+    uint16_t indices = Heap_calloc(self, 1, AVR_POINTER);
+    controls = Heap_realloc(self, controls, (i+1)*AVR_POINTER);
+
+    fgetc(in); // pin
+    fgetc(in); // mode
+    num_screen_indices = fgetc(in);
+    for(uint16_t k=0; k<num_screen_indices; k++) {
+      fgetc(in);
+      indices = Heap_realloc(self, indices, k+1);
+    }
+  }
+
+  num_screens = fgetc(in);
+  replays = (ScreenReplay*) calloc(num_screens+1, sizeof(ScreenReplay));
+
+  for(uint16_t i=0; i<num_screens; i++) {
+    ScreenReplay* screen = &replays[i];
+
+    // Screen_new()
+    Heap_calloc(self, 1, AVR_SCREEN);
+    screen->controls = Heap_calloc(self, 1, AVR_POINTER);
+    samples = Heap_calloc(self, 1, AVR_POINTER);
+    Heap_new_command_list(self, &commands);
+    Heap_calloc(self, SCREEN_ROWS, AVR_POINTER);
+
+    screens = Heap_realloc(self, screens, (i+1)*AVR_POINTER);
+
+    fgetc(in); // mode
+    Heap_read_command_list(self, commands, screen, in);
+
+    num_samples = fgetc(in);
+    for(uint16_t k=0; k<num_samples; k++) {
+
+      // Sample_new()
+      Heap_calloc(self, 1, AVR_SAMPLE);
+      pins = Heap_calloc(self, 1, AVR_POINTER);
+      Heap_new_command_list(self, &commands);
+      lists = Heap_calloc(self, 1, AVR_POINTER);
+
+      samples = Heap_realloc(self, samples, (k+1)*AVR_POINTER);
+
+      num_pins = fgetc(in);
+      for(uint8_t l=0; l<num_pins; l++) {
+        fgetc(in);
+        pins = Heap_realloc(self, pins, (l+1)*AVR_POINTER);
+      }
+
+      Heap_read_command_list(self, commands, screen, in);
+
+      for(uint16_t l=0; l<(1<<num_pins); l++) {
+        Heap_new_command_list(self, &commands);
+        Heap_read_command_list(self, commands, screen, in);
+        lists = Heap_realloc(self, lists, (l+1)*AVR_POINTER);
+      }
+    }
+  }
+  if(feof(in)) {
+    goto done;
+  }
+
+  // Config_assign_controls_to_screens()
+  fseek(in, assignments, SEEK_SET);
+  num_controls = fgetc(in);
+
+  for(uint16_t i=0; i<num_controls; i++) {
+    fgetc(in);
+    fgetc(in);
+    num_screen_indices = fgetc(in);
+
+    for(uint16_t k=0; k<num_screen_indices; k++) {
+      if((index = fgetc(in)) < num_screens) {
+        ScreenReplay* screen = &replays[index];
+        screen->num_controls++;
+        screen->controls = Heap_realloc(self, screen->controls,
+                                        screen->num_controls*AVR_POINTER);
+      }
+    }
+  }
+
+  // Config_allocate_rows()
+  for(uint16_t i=0; i<num_screens; i++) {
+    for(uint8_t k=0; k<replays[i].num_rows; k++) {
+      Heap_calloc(self, SCREEN_COLUMNS, 1);
+    }
+  }
+  result = true;
+
+ done:
+  free(replays);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool Config_get_heap_usage(volatile Config* self, HeapUsage* usage) {
+  FILE *tmp = NULL;
+  Heap *heap = NULL;
+  bool result = false;
+  int stack = HEAP_SRAM_END - HEAP_STACK_MAIN;
+
+  memset(usage, 0, sizeof(HeapUsage));
+
+  if((tmp = tmpfile()) == NULL) {
+    goto done;
+  }
+  Config_write(self, tmp);
+  rewind(tmp);
+
+  heap = Heap_new(HEAP_START, stack - HEAP_MARGIN);
+
+  if(!Heap_read_config(heap, tmp)) {
+    goto done;
+  }
+
+  usage->peak = heap->peak - heap->start;
+  usage->used = heap->brkval - heap->start;
+
+  for(uint16_t chunk = heap->flp; chunk; chunk = Heap_get(heap, NEXT(chunk))) {
+    usage->wasted += Heap_get(heap, SIZE(chunk)) + HEADER;
+    usage->holes++;
+  }
+
+  // Live text pushed from the host allocates a row of its own for
+  // each row it's written to, at any time once the config is in use
+  for(uint8_t i=0; i<SCREEN_ROWS; i++) {
+    Heap_malloc(heap, AVR_LIVE_ROW);
+  }
+  usage->live = heap->peak - heap->start - usage->peak;
+
+  usage->headroom = stack - heap->peak;
+  usage->slack = usage->headroom - HEAP_STACK_INTERRUPTS;
+  usage->fits = !heap->failed && usage->slack >= 0;
+  result = true;
+
+ done:
+  if(heap != NULL) Heap_free(heap);
+  if(tmp != NULL) fclose(tmp);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+uint16_t Config_get_footprint(volatile Config* self) {
+  HeapUsage usage;
+  return Config_get_heap_usage(self, &usage) ? usage.peak : 0;
+}
+
+//-----------------------------------------------------------------------------
+
+// The heap taken by the rows live text has allocated so far
+
+uint16_t Live_get_footprint(Live* self) {
+  uint16_t footprint = 0;
+
+  for(uint8_t i=0; i<SCREEN_ROWS; i++) {
+    if(self->rows[i] != NULL) {
+      footprint += AVR_LIVE_ROW + HEADER;
+    }
+  }
+  return footprint;
+}
@@ -0,0 +1,84 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "firmware/live.h"
+
+// SRAM of the ATmega1284P, mapped right after the i/o registers
+#define HEAP_SRAM_START 0x0100
+#define HEAP_SRAM_SIZE  16384
+#define HEAP_SRAM_END   (HEAP_SRAM_START+HEAP_SRAM_SIZE)
+
+// .data and .bss of the firmware, below __heap_start: the font (768),
+// the event queue (448), version string (64), live row pointers (60),
+// the v-usb driver (~60), string literals (~170) and other globals
+#define HEAP_STATIC     1650
+#define HEAP_START      (HEAP_SRAM_START+HEAP_STATIC)
+#define HEAP_MARGIN     32 // __malloc_margin, kept free below the stack
+
+// Stack used by the main loop at its deepest, in Row_printf() calling
+// snprintf(), and by each interrupt, which may all nest on top of it
+#define HEAP_STACK_MAIN       180
+#define HEAP_STACK_VSYNC      40 // INT1, calls Config_tick()
+#define HEAP_STACK_HSYNC      12 // PCINT1
+#define HEAP_STACK_BACK_PORCH 16 // INT2
+#define HEAP_STACK_USB        24 // INT0, the v-usb driver
+#define HEAP_STACK_INTERRUPTS (HEAP_STACK_VSYNC + HEAP_STACK_HSYNC + \
+                               HEAP_STACK_BACK_PORCH + HEAP_STACK_USB)
+
+// A model of SRAM managed by avr-libc's malloc(), with the chunk
+// headers and the freelist kept in it just like on the device
+typedef struct {
+  uint8_t ram[HEAP_SRAM_END];
+  uint16_t flp;    // __flp, the freelist ordered by address
+  uint16_t brkval; // __brkval, the top of the heap
+  uint16_t start;  // __heap_start
+  uint16_t limit;  // the stack pointer minus __malloc_margin
+  uint16_t peak;   // highest __brkval so far
+  bool failed;     // an allocation returned NULL
+} Heap;
+
+typedef struct {
+  uint16_t peak;   // largest size of the heap while reading the config
+  uint16_t used;   // size of the heap once it's read
+  uint16_t wasted; // free chunks left below the top of the heap
+  uint8_t holes;
+  uint16_t live;   // more at peak with live text in every row
+  int headroom;    // between the heap at its peak and the main loop's stack
+  int slack;       // what's left of it with all interrupts nested
+  bool fits;
+} HeapUsage;
+
+Heap* Heap_new(uint16_t start, uint16_t limit);
+uint16_t Heap_malloc(Heap* self, uint16_t len);
+uint16_t Heap_calloc(Heap* self, uint16_t count, uint16_t size);
+uint16_t Heap_realloc(Heap* self, uint16_t ptr, uint16_t len);
+void Heap_release(Heap* self, uint16_t ptr);
+void Heap_free(Heap* self);
+
+bool Config_get_heap_usage(volatile Config* self, HeapUsage* usage);
+uint16_t Config_get_footprint(volatile Config* self);
+uint16_t Live_get_footprint(Live* self);
+
+#endif // HEAP_H
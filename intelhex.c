@@ -10,34 +10,76 @@
 #include "intelhex/kk_ihex_write.h"
 #include "intelhex/kk_ihex_write.c"
 
+#include "intelhex.h"
+
+#define HEX_MAX_SIZE 0x20000
+
 static uint8_t* _buffer = NULL;
-static int _size = 0;
+static uint8_t* _used = NULL;
 static FILE* _out;
-static unsigned int _address;
 static bool successful;
+static bool overflow;
 //-----------------------------------------------------------------------------
 
-uint8_t* readhex(uint8_t *data, int *size, unsigned int *address) {
+Segment* readhex(uint8_t *data, int size, int *count) {
+
+  Segment *segments = NULL;
+  unsigned int start;
+  unsigned int end;
   
-  _buffer = (uint8_t*) calloc(0x20000, sizeof(uint8_t));
-  memset(_buffer, 0xff, 0x20000);
+  _buffer = (uint8_t*) malloc(HEX_MAX_SIZE);
+  _used = (uint8_t*) calloc(HEX_MAX_SIZE, sizeof(uint8_t));
+  memset(_buffer, 0xff, HEX_MAX_SIZE);
   
-  _size = 0;
-  _address = UINT_MAX;
   successful = false;
+  overflow = false;
+  (*count) = 0;
   
   struct ihex_state ihex;
   ihex_begin_read(&ihex);
-  ihex_read_bytes(&ihex, (const char*) data, (*size));
+  ihex_read_bytes(&ihex, (const char*) data, size);
   ihex_end_read(&ihex);
 
-  if(successful) {
-    if(data) free(data);
-    (*size) = _size;
-    (*address) = _address;
-    return _buffer;
+  if(!successful || overflow) {
+    successful = false;
+    goto done;
+  }
+
+  // Collect each run of populated addresses, in ascending order, so
+  // that gaps between them never have to be transferred
+  for(start=0; start<HEX_MAX_SIZE; start=end) {
+
+    for(; start<HEX_MAX_SIZE && !_used[start]; start++);
+    for(end=start; end<HEX_MAX_SIZE && _used[end]; end++);
+
+    if(start == end) break;
+
+    segments = (Segment*) realloc(segments, ((*count)+1) * sizeof(Segment));
+    segments[*count].address = start;
+    segments[*count].size = end - start;
+    segments[*count].data = (uint8_t*) malloc(end - start);
+    memcpy(segments[*count].data, _buffer + start, end - start);
+    (*count)++;
+  }
+
+  if(!(*count)) {
+    successful = false;
+  }
+  
+ done:
+  free(_buffer);
+  free(_used);
+  _buffer = _used = NULL;
+  return successful ? segments : NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+void free_segments(Segment *segments, int count) {
+  for(int i=0; i<count; i++) {
+    free(segments[i].data);
   }
-  return NULL;
+  free(segments);
 }
 
 //-----------------------------------------------------------------------------
@@ -49,14 +91,15 @@ ihex_bool_t ihex_data_read (struct ihex_state *ihex,
   if(type == IHEX_DATA_RECORD) {
     unsigned long address = (unsigned long) IHEX_LINEAR_ADDRESS(ihex);
 
-    if(address < _address) {
-      _address = address;
+    if(address + ihex->length > HEX_MAX_SIZE) {
+      overflow = true;
+      return true;
     }
     
     for(int i=0; i<ihex->length; i++) {
       _buffer[address+i] = ihex->data[i];
+      _used[address+i] = true;
     }
-    _size = address - _address + ihex->length;
   }
   else if(type == IHEX_END_OF_FILE_RECORD) {
     successful = true;
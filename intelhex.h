@@ -1,7 +1,14 @@
 #ifndef INTELHEX_H
 #define INTELHEX_H
 
-uint8_t* readhex(uint8_t *data, int *size, unsigned int *address);
-uint8_t* writehex(uint8_t *data, int size, unsigned int address, FILE* out);
+typedef struct {
+  unsigned int address;
+  int size;
+  uint8_t *data;
+} Segment;
+
+Segment* readhex(uint8_t *data, int size, int *count);
+void free_segments(Segment *segments, int count);
+void writehex(uint8_t *data, int size, unsigned int address, FILE* out);
 
 #endif // INTELHEX_H
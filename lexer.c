@@ -0,0 +1,255 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#if !defined(WIN32) || defined(__CYGWIN__)
+#define LEXER_MMAP 1
+#include <sys/mman.h>
+#endif
+
+#include "lexer.h"
+
+#define LEXER_READ_SIZE 65536
+
+//-----------------------------------------------------------------------------
+// Make the whole input available at once, mapping regular files and reading
+// anything else (pipes, memory streams) into a single buffer
+//-----------------------------------------------------------------------------
+
+bool Lexer_open(Lexer *self, FILE *in) {
+  size_t capacity = 0;
+  size_t n;
+  char *data;
+
+  memset(self, 0, sizeof(Lexer));
+
+#ifdef LEXER_MMAP
+  struct stat st;
+  int fd = fileno(in);
+
+  if(fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    data = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data != MAP_FAILED) {
+      self->data = data;
+      self->size = st.st_size;
+      self->mapped = true;
+    }
+  }
+#endif
+
+  if(!self->mapped) {
+    fseek(in, 0, SEEK_SET);
+
+    do {
+      if(self->size == capacity) {
+        capacity += LEXER_READ_SIZE;
+        if((data = (char*) realloc(self->data, capacity)) == NULL) {
+          goto error;
+        }
+        self->data = data;
+      }
+      n = fread(self->data + self->size, sizeof(char), capacity - self->size, in);
+      self->size += n;
+    } while(n > 0);
+
+    if(ferror(in)) {
+      goto error;
+    }
+  }
+
+  // name and value of a definition are both stored here, each terminated
+  if((self->buffer = (char*) malloc(self->size+2)) == NULL) {
+    goto error;
+  }
+  
+  self->next = self->data;
+  self->pos = self->end = self->data;
+  return true;
+
+ error:
+  Lexer_close(self);
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+
+bool Lexer_next_line(Lexer *self) {
+  char *limit = self->data + self->size;
+  char *start;
+  char *end;
+  char *comment;
+  int quotes;
+  
+  while(self->next < limit) {
+    start = self->next;
+
+    if((end = (char*) memchr(start, '\n', limit - start)) != NULL) {
+      self->next = end+1;
+    }
+    else {
+      self->next = end = limit;
+    }
+    self->line++;
+
+    // skip leading whitespace
+    while(start < end && (*start == ' ' || *start == '\t')) start++;
+
+    // skip empty lines and comments
+    if(start == end || *start == '\r' || *start == '#') continue;
+
+    // remove comment at the end of the line, unless it starts within quotes
+    if((comment = (char*) memchr(start, '#', end - start)) != NULL) {
+      quotes = 0;
+      for(char *c = start; c < comment; c++) {
+        if(*c == '"') quotes++;
+      }
+      if(quotes % 2 == 0) {
+        end = comment;
+      }
+    }
+
+    // discard carriage return
+    if(end > start && end[-1] == '\r') end--;
+
+    self->pos = start;
+    self->end = end;
+    self->literal = false;
+    self->escaped = false;
+    return true;
+  }
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+
+bool Lexer_get_definition(Lexer *self, Token *name, Token *value) {
+  char *equals;
+  char *start = self->pos;
+  char *end;
+
+  if((equals = (char*) memchr(self->pos, '=', self->end - self->pos)) == NULL) {
+    return false;
+  }
+
+  // the name ends at the first whitespace before the equals sign
+  for(end = start; end < equals && *end != ' ' && *end != '\t'; end++);
+
+  name->text = self->buffer;
+  name->len = end - start;
+  name->offset = start - self->data;
+  name->line = self->line;
+  memcpy(name->text, start, name->len);
+  name->text[name->len] = '\0';
+
+  // the value is trimmed on both ends
+  start = equals+1;
+  end = self->end;
+  while(start < end && isspace((unsigned char) *start)) start++;
+  while(end > start && isspace((unsigned char) end[-1])) end--;
+
+  value->text = name->text + name->len + 1;
+  value->len = end - start;
+  value->offset = start - self->data;
+  value->line = self->line;
+  memcpy(value->text, start, value->len);
+  value->text[value->len] = '\0';
+
+  self->pos = self->end;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Quoted strings keep their opening quote to tell them apart from plain
+// words, a backslash takes the next character literally
+//-----------------------------------------------------------------------------
+
+bool Lexer_next_token(Lexer *self, Token *token, const char *delim) {
+  size_t len = 0;
+  char c;
+
+  if(delim != self->delim) {
+    memset(self->delims, false, sizeof(self->delims));
+    for(const char *d = delim; *d; d++) {
+      self->delims[(unsigned char) *d] = true;
+    }
+    self->delims[0] = true;
+    self->delim = delim;
+  }
+
+  token->offset = self->pos - self->data;
+  token->line = self->line;
+  
+  while(self->pos < self->end) {
+    c = *self->pos++;
+
+    if(c == '\\' && !self->escaped) {
+      self->escaped = true;
+      continue;
+    }
+
+    if(c == '"' && !self->escaped) {
+      self->literal = !self->literal;
+      if(!self->literal) {
+        goto emit;
+      }
+    }
+
+    if((!self->literal) && self->delims[(unsigned char) c]) {
+      if(len) {
+        goto emit;
+      }
+      continue;
+    }
+
+    if(!len) {
+      token->offset = (self->pos-1) - self->data;
+    }
+    self->buffer[len++] = c;
+    self->escaped = false;
+  }
+
+  if(!len) {
+    return false;
+  }
+
+ emit:
+  self->buffer[len] = '\0';
+  token->text = self->buffer;
+  token->len = len;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void Lexer_close(Lexer *self) {
+#ifdef LEXER_MMAP
+  if(self->mapped) {
+    munmap(self->data, self->size);
+    self->data = NULL;
+  }
+#endif
+  free(self->data);
+  free(self->buffer);
+  self->data = self->buffer = NULL;
+}
@@ -0,0 +1,58 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct {
+  char *data;      // the whole input, mapped or read into memory
+  size_t size;
+  bool mapped;
+
+  char *next;      // start of the following line
+  char *pos;       // scan position within the current line
+  char *end;       // end of the current line, without comment and newline
+  int line;        // number of the current line
+
+  bool literal;    // inside a quoted string
+  bool escaped;    // after a backslash
+
+  const char *delim;
+  bool delims[256]; // lookup table for the characters in delim
+
+  char *buffer;    // holds the current token, never longer than the input
+} Lexer;
+
+typedef struct {
+  char *text;      // terminated, valid until the next call
+  size_t len;
+  size_t offset;   // of the first character in the input
+  int line;
+} Token;
+
+bool Lexer_open(Lexer *self, FILE *in);
+bool Lexer_next_line(Lexer *self);
+bool Lexer_get_definition(Lexer *self, Token *name, Token *value);
+bool Lexer_next_token(Lexer *self, Token *token, const char *delim);
+void Lexer_close(Lexer *self);
+
+#endif // LEXER_H
@@ -0,0 +1,708 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "parser.h"
+#include "optimizer.h"
+#include "heap.h"
+#include "firmware/config.h"
+
+// The command lists of a screen, in the order Screen_render() executes them
+typedef struct {
+  CommandList *list;
+  Sample *sample;  // NULL for the screen's own commands
+  bool always;     // executed whenever the screen is rendered
+  bool formatted;  // executed with the sample value, see Row_printf()
+} Block;
+
+// The cells of a row a command writes to
+typedef struct {
+  uint8_t row;
+  uint8_t start;
+  uint8_t end;
+} Span;
+
+//-----------------------------------------------------------------------------
+
+static bool Command_is_formatted(Command* self, Block* block) {
+  return block->formatted && self->action == ACTION_WRITE &&
+    strchr(self->string, '%') != NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+static Span Command_span(Command* self, Block* block) {
+  Span span = { self->row, self->col, self->col };
+  int end = self->col;
+
+  if(self->action == ACTION_WRITE) {
+    end += Command_is_formatted(self, block) ? SCREEN_COLUMNS : strlen(self->string);
+  }
+  else {
+    end += (uint8_t) self->len;
+  }
+  span.start = (span.start < SCREEN_COLUMNS) ? span.start : SCREEN_COLUMNS;
+  span.end = (end < SCREEN_COLUMNS) ? end : SCREEN_COLUMNS;
+  return span;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool Span_covers(Span self, Span span) {
+  return self.row == span.row && self.start <= span.start && self.end >= span.end;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool Span_overlaps(Span self, Span span) {
+  return self.row == span.row && self.start < span.end && span.start < self.end;
+}
+
+//-----------------------------------------------------------------------------
+
+static void CommandList_remove(CommandList* self, uint8_t index) {
+  Command_free(self->commands[index]);
+  self->num_commands--;
+  memmove(&self->commands[index], &self->commands[index+1],
+          (self->num_commands - index) * sizeof(Command*));
+}
+
+//-----------------------------------------------------------------------------
+
+static int Screen_get_blocks(Screen* self, Block** blocks) {
+  Sample *sample;
+  int count = 1;
+
+  for(uint8_t i=0; i<self->num_samples; i++) {
+    count += 1 + self->samples[i]->num_command_lists;
+  }
+  *blocks = (Block*) calloc(count, sizeof(Block));
+
+  count = 0;
+  (*blocks)[count++] = (Block) { self->commands, NULL, true, false };
+
+  for(uint8_t i=0; i<self->num_samples; i++) {
+    sample = self->samples[i];
+    (*blocks)[count++] = (Block) { sample->command_list, sample, true, true };
+
+    for(uint8_t k=0; k<sample->num_command_lists; k++) {
+      (*blocks)[count++] = (Block) { sample->command_lists[k], sample, false, false };
+    }
+  }
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+
+static int Config_count_references(volatile Config* self, char* string) {
+  Block *blocks;
+  int count;
+  int references = 0;
+
+  for(uint8_t i=0; i<self->num_screens; i++) {
+    count = Screen_get_blocks(self->screens[i], &blocks);
+
+    for(int b=0; b<count; b++) {
+      for(uint8_t k=0; k<blocks[b].list->num_commands; k++) {
+        if(blocks[b].list->commands[k]->string == string) references++;
+      }
+    }
+    free(blocks);
+  }
+  return references;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool Screen_can_remove(Screen* self, Block* blocks, int count,
+                              Block* block, Command* command) {
+  int uses = 0;
+
+  // Rows are allocated for the rows used by the commands, and a row of
+  // an enabled screen hides the same row of all screens after it
+  for(int b=0; b<count; b++) {
+    for(uint8_t k=0; k<blocks[b].list->num_commands; k++) {
+      if(blocks[b].list->commands[k]->row == command->row) uses++;
+    }
+  }
+  if(uses < 2) {
+    return false;
+  }
+
+  if(block->list->num_commands > 1) {
+    return true;
+  }
+
+  // A list must not run empty where that would disable the screen, see
+  // Screen_has_effect()
+  if(block->sample == NULL) {
+    return false;
+  }
+
+  if(block->list == block->sample->command_list) {
+    for(uint8_t i=0; i<block->sample->num_command_lists; i++) {
+      if(!block->sample->command_lists[i]->num_commands) return false;
+    }
+    return true;
+  }
+  return block->sample->command_list->num_commands > 0;
+}
+
+//-----------------------------------------------------------------------------
+// Commands that appear in every branch of a sample are executed once,
+// before the branch, as long as nothing the branch does first overlaps
+// them
+//-----------------------------------------------------------------------------
+
+static int CommandList_find_unobstructed(CommandList* self, Command* command, Block* block) {
+  Span span = Command_span(command, block);
+
+  for(uint8_t i=0; i<self->num_commands; i++) {
+    if(Command_equals(self->commands[i], command)) {
+      return i;
+    }
+    if(Span_overlaps(Command_span(self->commands[i], block), span)) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+//-----------------------------------------------------------------------------
+
+static int Sample_hoist(Sample* self, int* hoisted) {
+  Block branch = { NULL, self, false, false };
+  CommandList *first = self->command_lists[0];
+  Command *command;
+  int at[256];
+  int changes = 0;
+  bool common;
+  uint8_t i = 0;
+
+  if(self->num_command_lists < 2) {
+    return 0;
+  }
+
+  while(i<first->num_commands) {
+    command = first->commands[i];
+
+    // The sample's own list formats its strings with the sample value
+    if(command->action == ACTION_WRITE && strchr(command->string, '%') != NULL) {
+      i++;
+      continue;
+    }
+
+    common = true;
+    for(uint8_t k=0; k<self->num_command_lists && common; k++) {
+      at[k] = CommandList_find_unobstructed(self->command_lists[k], command, &branch);
+      common = at[k] >= 0;
+    }
+
+    // An equal command earlier in the list is what gets hoisted, if any
+    if(!common || at[0] != i) {
+      i++;
+      continue;
+    }
+
+    // The first branch gives up its command, the others drop theirs
+    first->num_commands--;
+    memmove(&first->commands[i], &first->commands[i+1],
+            (first->num_commands - i) * sizeof(Command*));
+
+    for(uint8_t k=1; k<self->num_command_lists; k++) {
+      CommandList_remove(self->command_lists[k], at[k]);
+      (*hoisted)++;
+    }
+    CommandList_add_command(self->command_list, command);
+    changes++;
+  }
+  return changes;
+}
+
+//-----------------------------------------------------------------------------
+// Adjacent commands are joined, clears always, writes only when that
+// makes the configuration smaller, since their strings may be shared
+//-----------------------------------------------------------------------------
+
+static int CommandList_merge(CommandList* self, Block* block, volatile Config* config, int* merged) {
+  Command *a, *b;
+  Span sa, sb;
+  char *string, *existing;
+  int la, lb, saved;
+  int changes = 0;
+  uint8_t index;
+  uint8_t i = 0;
+
+  while(i+1 < self->num_commands) {
+    a = self->commands[i];
+    b = self->commands[i+1];
+    sa = Command_span(a, block);
+    sb = Command_span(b, block);
+
+    if(a->row != b->row || a->action != b->action ||
+       sa.start >= sa.end || sb.start >= sb.end) {
+      i++;
+      continue;
+    }
+
+    if(a->action == ACTION_CLEAR) {
+      if(sb.start < sa.start || sb.start > sa.end) {
+        i++;
+        continue;
+      }
+      a->len = ((sb.end > sa.end) ? sb.end : sa.end) - sa.start;
+      CommandList_remove(self, i+1);
+      changes++;
+      continue;
+    }
+
+    la = strlen(a->string);
+    lb = strlen(b->string);
+
+    if(Command_is_formatted(a, block) || Command_is_formatted(b, block) ||
+       a->col + la != b->col || la + lb > 0xff) {
+      i++;
+      continue;
+    }
+
+    string = (char*) calloc(la + lb + 1, sizeof(char));
+    strcpy(string, a->string);
+    strcpy(string + la, b->string);
+
+    // A command takes five bytes, a string its length plus one
+    saved = 5;
+    if(a->string == b->string) {
+      saved += (Config_count_references(config, a->string) == 2) ? la+1 : 0;
+    }
+    else {
+      saved += (Config_count_references(config, a->string) == 1) ? la+1 : 0;
+      saved += (Config_count_references(config, b->string) == 1) ? lb+1 : 0;
+    }
+
+    existing = NULL;
+    if(Config_has_string(config, string, &index)) {
+      existing = config->strings[index];
+    }
+    if(existing == NULL || Config_count_references(config, existing) == 0) {
+      saved -= la+lb+1;
+    }
+
+    if(saved <= 0 || (existing == NULL && config->num_strings >= 0xff)) {
+      free(string);
+      i++;
+      continue;
+    }
+    Command_set_string(a, existing ? existing : Config_add_string(config, string));
+    free(string);
+
+    CommandList_remove(self, i+1);
+    changes++;
+  }
+  *merged += changes;
+  return changes;
+}
+
+//-----------------------------------------------------------------------------
+// Commands whose cells are all overwritten by a command that's certain
+// to be executed after them are removed
+//-----------------------------------------------------------------------------
+
+static int Screen_remove_shadowed(Screen* self, Block* blocks, int count, int* shadowed) {
+  Block *block;
+  Command *command;
+  Span span;
+  bool covered;
+  int changes = 0;
+  uint8_t i;
+
+  for(int b=0; b<count; b++) {
+    block = &blocks[b];
+    i = 0;
+
+    while(i<block->list->num_commands) {
+      command = block->list->commands[i];
+      span = Command_span(command, block);
+      covered = false;
+
+      if(!Command_is_formatted(command, block) && span.start < span.end) {
+        for(int n=b; n<count && !covered; n++) {
+          if(n != b && !blocks[n].always) continue;
+
+          for(uint8_t k=(n == b) ? i+1 : 0; k<blocks[n].list->num_commands && !covered; k++) {
+            covered = !Command_is_formatted(blocks[n].list->commands[k], &blocks[n]) &&
+              Span_covers(Command_span(blocks[n].list->commands[k], &blocks[n]), span);
+          }
+        }
+      }
+
+      if(covered && Screen_can_remove(self, blocks, count, block, command)) {
+        CommandList_remove(block->list, i);
+        changes++;
+      }
+      else {
+        i++;
+      }
+    }
+  }
+  *shadowed += changes;
+  return changes;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool Screen_may_set(Screen* self, Block* blocks, int count, Span span) {
+  Command *command;
+  char *string;
+
+  // Cells start out cleared and only writes of anything but spaces
+  // set them, see Row_write()
+  for(int b=0; b<count; b++) {
+    for(uint8_t k=0; k<blocks[b].list->num_commands; k++) {
+      command = blocks[b].list->commands[k];
+
+      if(command->action != ACTION_WRITE || command->row != span.row) continue;
+
+      if(Command_is_formatted(command, &blocks[b])) {
+        if(Span_overlaps(Command_span(command, &blocks[b]), span)) return true;
+        continue;
+      }
+
+      string = command->string;
+      for(int c=command->col; *string && c<span.end; c++, string++) {
+        if(c >= span.start && *string != ' ') return true;
+      }
+    }
+  }
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+// Commands entirely off screen and clears of cells nothing ever sets
+// are removed
+//-----------------------------------------------------------------------------
+
+static int Screen_drop_noops(Screen* self, Block* blocks, int count, int* dropped) {
+  Block *block;
+  Command *command;
+  Span span;
+  bool noop;
+  int changes = 0;
+  uint8_t i;
+
+  for(int b=0; b<count; b++) {
+    block = &blocks[b];
+    i = 0;
+
+    while(i<block->list->num_commands) {
+      command = block->list->commands[i];
+      span = Command_span(command, block);
+
+      noop = !Command_is_formatted(command, block) &&
+        (span.start >= span.end ||
+         (command->action == ACTION_CLEAR && !Screen_may_set(self, blocks, count, span)));
+
+      if(noop && Screen_can_remove(self, blocks, count, block, command)) {
+        CommandList_remove(block->list, i);
+        changes++;
+      }
+      else {
+        i++;
+      }
+    }
+  }
+  *dropped += changes;
+  return changes;
+}
+
+//-----------------------------------------------------------------------------
+
+static void Config_collect_strings(volatile Config* self) {
+  char **strings = (char**) calloc(self->num_strings ? self->num_strings : 1, sizeof(char*));
+  uint8_t count = 0;
+  Block *blocks;
+  Command *command;
+  int num_blocks;
+  uint8_t k;
+
+  // Strings are renumbered in the order they are first used, which is
+  // the order the parser would have added them in
+  for(uint8_t i=0; i<self->num_screens; i++) {
+    num_blocks = Screen_get_blocks(self->screens[i], &blocks);
+
+    for(int b=0; b<num_blocks; b++) {
+      for(uint8_t c=0; c<blocks[b].list->num_commands; c++) {
+        command = blocks[b].list->commands[c];
+        if(command->action != ACTION_WRITE) continue;
+
+        for(k=0; k<count && strings[k] != command->string; k++);
+        if(k == count) strings[count++] = command->string;
+      }
+    }
+    free(blocks);
+  }
+
+  for(uint8_t i=0; i<self->num_strings; i++) {
+    for(k=0; k<count && strings[k] != self->strings[i]; k++);
+    if(k == count) free(self->strings[i]);
+  }
+  free(self->strings);
+  self->strings = strings;
+  self->num_strings = count;
+
+  free(self->interned);
+  self->interned = NULL;
+  self->interned_size = 0;
+  self->num_interned = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool is_integer_format(const char* format) {
+
+  // Row_printf() passes the sample value for every conversion
+  while((format = strchr(format, '%')) != NULL) {
+    format += strspn(format+1, "-+ #0123456789.*hl") + 1;
+
+    if(*format == '\0' || strchr("diouxXc%", *format) == NULL) {
+      return false;
+    }
+    format++;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool Config_is_optimizable(volatile Config* self) {
+  Block *blocks;
+  Command *command;
+  int count;
+  bool result = true;
+
+  for(uint8_t i=0; i<self->num_screens && result; i++) {
+    count = Screen_get_blocks(self->screens[i], &blocks);
+
+    for(int b=0; b<count && result; b++) {
+      for(uint8_t k=0; k<blocks[b].list->num_commands && result; k++) {
+        command = blocks[b].list->commands[k];
+
+        if(command->action == ACTION_WRITE) {
+          result = command->string != NULL &&
+            (!blocks[b].formatted || is_integer_format(command->string));
+        }
+        else {
+          result = command->action == ACTION_CLEAR;
+        }
+      }
+    }
+    free(blocks);
+  }
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+static uint32_t Screen_get_rows_used(Screen* self) {
+  Block *blocks;
+  int count = Screen_get_blocks(self, &blocks);
+  uint32_t rows = 0;
+
+  for(int b=0; b<count; b++) {
+    for(uint8_t k=0; k<blocks[b].list->num_commands; k++) {
+      rows |= 1UL << blocks[b].list->commands[k]->row;
+    }
+  }
+  free(blocks);
+  return rows;
+}
+
+//-----------------------------------------------------------------------------
+
+static void Screen_clear_rows(Screen* self) {
+  for(uint8_t i=0; i<SCREEN_ROWS; i++) {
+    if(self->rows[i] != NULL) {
+      memset(self->rows[i], 0, SCREEN_COLUMNS);
+    }
+  }
+  for(uint8_t i=0; i<self->num_samples; i++) {
+    self->samples[i]->value = 0;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Both screens are rendered by the firmware's own code, through every
+// combination of sample values in turn, or a random walk through them
+// if there are too many. Since the rows keep what was written to them,
+// each state also starts from what the one before it left behind.
+//-----------------------------------------------------------------------------
+
+static bool Screen_renders_like(Screen* self, Screen* reference) {
+  uint32_t states = 1;
+  uint32_t state;
+  uint32_t seed = 1;
+  bool exhaustive = true;
+  bool result = false;
+  uint8_t value;
+
+  if(self->num_samples != reference->num_samples ||
+     Screen_get_rows_used(self) != Screen_get_rows_used(reference)) {
+    return false;
+  }
+
+  for(uint8_t i=0; i<self->num_samples && exhaustive; i++) {
+    if(states > OPTIMIZER_MAX_STATES / self->samples[i]->num_command_lists) {
+      exhaustive = false;
+    }
+    states *= self->samples[i]->num_command_lists;
+  }
+  states = exhaustive ? states : OPTIMIZER_MAX_STATES;
+
+  Screen_clear_rows(self);
+  Screen_clear_rows(reference);
+
+  for(uint32_t n=0; n<states; n++) {
+    state = n;
+
+    for(uint8_t i=0; i<self->num_samples; i++) {
+      if(exhaustive) {
+        value = state % self->samples[i]->num_command_lists;
+        state /= self->samples[i]->num_command_lists;
+      }
+      else {
+        seed = seed * 1103515245 + 12345;
+        value = (seed >> 16) % self->samples[i]->num_command_lists;
+      }
+      self->samples[i]->value = reference->samples[i]->value = value;
+    }
+
+    if(Screen_has_effect(self) != Screen_has_effect(reference)) {
+      goto done;
+    }
+    if(!Screen_has_effect(reference)) {
+      continue;
+    }
+
+    Screen_render(self);
+    Screen_render(reference);
+
+    for(uint8_t i=0; i<SCREEN_ROWS; i++) {
+      if(reference->rows[i] != NULL &&
+         memcmp(self->rows[i], reference->rows[i], SCREEN_COLUMNS) != 0) {
+        goto done;
+      }
+    }
+  }
+  result = true;
+
+ done:
+  Screen_clear_rows(self);
+  Screen_clear_rows(reference);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+static uint16_t Config_measure(volatile Config* self, FILE* out) {
+  uint16_t written;
+
+  rewind(out);
+  written = Config_write(self, out);
+  fflush(out);
+  rewind(out);
+  return written;
+}
+
+//-----------------------------------------------------------------------------
+
+volatile Config* Config_optimize(volatile Config* self, Optimization* result) {
+  volatile Config* copy = NULL;
+  FILE *tmp = NULL;
+  Screen *screen;
+  Block *blocks;
+  int count;
+  int changes;
+  uint16_t before;
+
+  memset(result, 0, sizeof(Optimization));
+
+  if(!Config_is_optimizable(self) || (tmp = tmpfile()) == NULL) {
+    goto done;
+  }
+
+  // The pass works on a copy, so that the original is still around to
+  // compare against, and to fall back to
+  before = Config_measure(self, tmp);
+  copy = Config_new();
+
+  // Configs with more than the binary format can count don't read back
+  if(!Config_read(copy, tmp) || Config_measure(copy, tmp) != before) {
+    goto error;
+  }
+
+  // Each step may open up opportunities for the others
+  do {
+    changes = 0;
+
+    for(uint8_t i=0; i<copy->num_screens; i++) {
+      screen = copy->screens[i];
+      count = Screen_get_blocks(screen, &blocks);
+
+      for(uint8_t k=0; k<screen->num_samples; k++) {
+        changes += Sample_hoist(screen->samples[k], &result->hoisted);
+      }
+      for(int b=0; b<count; b++) {
+        changes += CommandList_merge(blocks[b].list, &blocks[b], copy, &result->merged);
+      }
+      changes += Screen_remove_shadowed(screen, blocks, count, &result->shadowed);
+      changes += Screen_drop_noops(screen, blocks, count, &result->dropped);
+
+      free(blocks);
+    }
+  } while(changes);
+
+  Config_collect_strings(copy);
+
+  for(uint8_t i=0; i<copy->num_screens; i++) {
+    if(!Screen_renders_like(copy->screens[i], self->screens[i])) {
+      fprintf(parser_log, "warning: optimizing screen %d changed what it shows, "
+              "writing the configuration as is\n", i);
+      goto error;
+    }
+  }
+
+  result->eeprom = before - Config_measure(copy, tmp);
+  result->sram = Config_get_footprint(self) - Config_get_footprint(copy);
+
+  Config_free(self);
+  goto done;
+
+ error:
+  Config_free(copy);
+  copy = NULL;
+  memset(result, 0, sizeof(Optimization));
+
+ done:
+  if(tmp != NULL) fclose(tmp);
+  return (copy != NULL) ? copy : self;
+}
@@ -0,0 +1,41 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#define OPTIMIZER_MAX_STATES 4096 // sample states rendered per screen to verify
+
+typedef struct {
+  int hoisted;  // commands common to all branches, moved out of them
+  int shadowed; // commands entirely overwritten later on
+  int merged;   // adjacent commands joined into one
+  int dropped;  // commands that never change what's shown
+
+  int eeprom;   // bytes saved
+  int sram;
+} Optimization;
+
+volatile Config* Config_optimize(volatile Config* self, Optimization* result);
+
+#endif // OPTIMIZER_H
@@ -22,10 +22,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 #include "target.h"
 
+#if linux
+  #include <poll.h>
+  #include <sys/inotify.h>
+#endif
+
 #if windows  
   #include <io.h>
   #include <fcntl.h>
@@ -36,10 +44,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 
 #include "parser.h"
+#include "optimizer.h"
+#include "heap.h"
+#include "render.h"
 #include "usb.h"
 #include "protocol.h"
 #include "intelhex.h"
 #include "overlay64.h"
+#include "emulator.h"
+#include "firmware/font.h"
 
 //-----------------------------------------------------------------------------
 
@@ -49,10 +62,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
   char* device = "usb";
 #endif
 
-DeviceInfo overlay64;
-DeviceInfo usbasp;
+// Each worker of a fleet run drives its own pair of devices and logs
+// what happens to them, everything else talks to the console
+__thread DeviceInfo overlay64;
+__thread DeviceInfo usbasp;
+static __thread FILE *worker_log = NULL;
+static __thread Unit *worker_unit = NULL;
+static pthread_mutex_t fleet_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define console (worker_log != NULL ? worker_log : stderr)
 
-extern uint16_t written;
+bool verify = false;
 
 //-----------------------------------------------------------------------------
 
@@ -63,12 +83,25 @@ int main(int argc, char **argv) {
   struct option options[] = {
     { "help",     no_argument,       0, 'h' },
     { "version",  no_argument,       0, 'v' },
+    { "all",      no_argument,       0, 'a' },
+    { "verify",   no_argument,       0, 'V' },
+    { "emulate",  optional_argument, 0, 'e' },
+    { "jobs",     required_argument, 0, 'j' },
+    { "output",   required_argument, 0, 'o' },
+    { "pins",     required_argument, 0, 'p' },
+    { "font",     required_argument, 0, 'f' },
     { 0, 0, 0, 0 },
   };
   int option, option_index;
+  bool all = false;
+  int emulate = 0;
+  int jobs = 0;
+  char *outdir = NULL;
+  char *levels = NULL;
+  char *fontfile = NULL;
   
   while(1) {
-    option = getopt_long(argc, argv, "hv", options, &option_index);
+    option = getopt_long(argc, argv, "hvaVe::j:o:p:f:", options, &option_index);
 
     if(option == -1)
       break;
@@ -84,6 +117,34 @@ int main(int argc, char **argv) {
       version();
       goto done;
       break;
+
+    case 'a':
+      all = true;
+      break;
+
+    case 'V':
+      verify = true;
+      break;
+
+    case 'e':
+      emulate = (optarg != NULL) ? atoi(optarg) : 1;
+      break;
+
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+
+    case 'o':
+      outdir = optarg;
+      break;
+
+    case 'p':
+      levels = optarg;
+      break;
+
+    case 'f':
+      fontfile = optarg;
+      break;
             
     case '?':
     case ':':
@@ -94,13 +155,42 @@ int main(int argc, char **argv) {
   argc -= optind;
   argv += optind;
 
+  // Talk to devices emulated in-process instead of real hardware
+  if(emulate) {
+    if(!emulator_setup(emulate)) {
+      result = false;
+      goto done;
+    }
+    usb_set_transport(&usb_emulator);
+  }
+
   prepare_devices();
+
+  if(all) {
+    result = fleet(argc, argv);
+  }
+
+  else if(outdir != NULL || jobs) {
+    if(outdir != NULL && argc >= 2 && strncmp(argv[0], "convert", 4) == 0) {
+      result = convert_batch(--argc, ++argv, outdir, jobs);
+    }
+    else if(outdir != NULL && argc == 2 && strcmp(argv[0], "render") == 0) {
+      result = render(argv[1], outdir, levels, fontfile, jobs);
+    }
+    else goto usage;
+  }
   
-  if(argc == 1) {
+  else if(argc == 1) {
 
     if(is_file(argv[0])) {
       result = configure(argc, argv);
     }
+    else if(strcmp(argv[0], "benchmark") == 0) {
+      result = benchmark();
+    }
+    else if(strcmp(argv[0], "monitor") == 0) {
+      result = monitor(0, NULL);
+    }
     else if(strncmp(argv[0], "boot", 1) == 0) {
       result = boot();
     }
@@ -118,9 +208,21 @@ int main(int argc, char **argv) {
     if(strncmp(argv[0], "configure", 4) == 0) {
       result = configure(--argc, ++argv);
     }
+    else if(strcmp(argv[0], "update") == 0) {
+      result = update(--argc, ++argv);
+    }
     else if(strcmp(argv[0], "font-update") == 0) {
       result = font_update(argv[1]);
     }
+    else if(strcmp(argv[0], "monitor") == 0) {
+      result = monitor(--argc, ++argv);
+    }
+    else if(strcmp(argv[0], "benchmark") == 0) {
+      result = benchmark_parse(argv[1]);
+    }
+    else if(strcmp(argv[0], "watch") == 0) {
+      result = watch(argv[1]);
+    }
     else goto usage;
   }
 
@@ -134,6 +236,16 @@ int main(int argc, char **argv) {
     else if(strcmp(argv[0], "font-convert") == 0) {
       result = font_convert(argv[1], argv[2]);
     }
+    else if(strcmp(argv[0], "input") == 0) {
+      result = input(--argc, ++argv);
+    }
+    else goto usage;
+  }
+
+  else if(argc == 4) {
+    if(strcmp(argv[0], "write") == 0) {
+      result = write_text(--argc, ++argv);
+    }
     else goto usage;
   }
 
@@ -145,64 +257,479 @@ int main(int argc, char **argv) {
   }
   
  done:
+  usb_close(&overlay64);
+  usb_close(&usbasp);
+  usb_exit();
+  
   return result ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 //-----------------------------------------------------------------------------
 
+static bool ends_with(const char *str, const char *end) {
+  if(str == NULL || end == NULL) return false;
+  if(strlen(end) > strlen(str)) return false;
+  return strncasecmp(str+strlen(str)-strlen(end), end, strlen(end)) == 0;
+}
+
+//-----------------------------------------------------------------------------
+
 bool convert(int argc, char **argv) {
+  return convert_file(argv[0], argv[1]);
+}
+
+//-----------------------------------------------------------------------------
+
+bool convert_file(char *input, char *output) {
 
   bool result = false;
 
   FILE *in  = stdin;
   FILE *out = stdout;
   Format output_format = BINARY;
-
-  config = Config_new();
+  volatile Config *config = Config_new();
+  Optimization optimization;
+  uint16_t written = 0;
   
-  if(argc >= 1 && (strncmp(argv[0], "-", 1) != 0)) {
+  if(strncmp(input, "-", 1) != 0) {
 
-    if((in = fopen(argv[0], "rb")) == NULL) {
-      fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    if((in = fopen(input, "rb")) == NULL) {
+      fprintf(console, "%s: %s\n", input, strerror(errno));
       goto done;
     }
   }
 
-  if(argc >= 2 && (strncmp(argv[1], "-", 1) != 0)) {
+  if(strncmp(output, "-", 1) != 0) {
 
-    if((out = fopen(argv[1], "wb")) == NULL) {
-      fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+    if((out = fopen(output, "wb")) == NULL) {
+      fprintf(console, "%s: %s\n", output, strerror(errno));
       goto done;
     }
   }
 
   if(in == stdin) {
-    fprintf(stderr, "Reading from stdin...\n");
+    fprintf(console, "Reading from stdin...\n");
 #if windows
     setmode(_fileno(stdin), O_BINARY);
 #endif
   }
 
   if(out == stdout) {
-    fprintf(stderr, "Writing to stdout...\n");
+    fprintf(console, "Writing to stdout...\n");
 #if windows
     setmode(_fileno(stdout), O_BINARY);
 #endif
   }
   
   if((Config_read(config, in)  && (output_format = CONFIG)) ||
-     (Config_parse(config, in) && (output_format = BINARY))) {
+     (Config_parse(config, in, (in == stdin) ? NULL : input) && (output_format = BINARY))) {
     
-    output_format == BINARY ?
-      Config_write(config, out) :
+    if(output_format == BINARY) {
+      config = Config_optimize(config, &optimization);
+      written = Config_write(config, out);
+    }
+    else {
       Config_print(config, out);
+    }
 
-    footprint(config);
+    footprint(config, written, (output_format == BINARY) ? &optimization : NULL);
     
     result = true;
   }
 
  done:
+  if(in != NULL && in != stdin) fclose(in);
+  if(out != NULL && out != stdout) fclose(out);
+  Config_free(config);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct {
+  char *input;
+  char *output;
+  bool result;
+  char *log;   // diagnostics, shown once all jobs are done
+} Job;
+
+typedef struct {
+  Job *jobs;
+  int count;
+  int next;
+} Batch;
+
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* batch_worker(void *context) {
+
+  Batch *batch = (Batch *) context;
+  Job *job;
+  long size;
+  int i;
+
+  while(true) {
+    pthread_mutex_lock(&batch_lock);
+    i = batch->next++;
+    pthread_mutex_unlock(&batch_lock);
+
+    if(i >= batch->count) break;
+    job = &batch->jobs[i];
+
+    // Keep what the parser and converter have to say about each file
+    // apart, so that it can be reported in order afterwards
+    worker_log = parser_log_stream = tmpfile();
+
+    job->result = convert_file(job->input, job->output);
+
+    if(worker_log != NULL) {
+      fseek(worker_log, 0, SEEK_END);
+      size = ftell(worker_log);
+      rewind(worker_log);
+
+      job->log = (char *) calloc(size+1, sizeof(char));
+      size = fread(job->log, sizeof(char), size, worker_log);
+      job->log[size] = '\0';
+      fclose(worker_log);
+    }
+    worker_log = parser_log_stream = NULL;
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+static char* batch_output(char *input, char *outdir, const char *suffix) {
+
+  char *base = input;
+  char *extension;
+  char *output;
+  int stem;
+
+  for(char *c = input; *c; c++) {
+    if(*c == '/' || *c == '\\') base = c+1;
+  }
+
+  extension = strrchr(base, '.');
+  stem = (extension != NULL && extension != base) ? extension - base : strlen(base);
+
+  output = (char *) calloc(strlen(outdir) + stem + strlen(suffix) + 2, sizeof(char));
+  sprintf(output, "%s%s%.*s%s", outdir,
+          ends_with(outdir, "/") ? "" : "/", stem, base, suffix);
+  return output;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool batch_directory(char *outdir) {
+#if defined(WIN32) && !defined(__CYGWIN__)
+  mkdir(outdir);
+#else
+  mkdir(outdir, 0755);
+#endif
+
+  if(!is_dir(outdir)) {
+    fprintf(stderr, "error: %s: not a directory\n", outdir);
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+static int batch_workers(int jobs) {
+  if(jobs <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(jobs <= 0) jobs = 1;
+  }
+  return (jobs > BATCH_MAX_WORKERS) ? BATCH_MAX_WORKERS : jobs;
+}
+
+//-----------------------------------------------------------------------------
+
+bool convert_batch(int argc, char **argv, char *outdir, int jobs) {
+
+  bool result = false;
+  Batch batch;
+  pthread_t workers[BATCH_MAX_WORKERS];
+  int threads = 0;
+  int failed = 0;
+
+  memset(&batch, 0, sizeof(Batch));
+
+  if(!batch_directory(outdir)) {
+    goto done;
+  }
+  
+  batch.count = argc;
+  batch.jobs = (Job *) calloc(argc, sizeof(Job));
+
+  for(int i=0; i<argc; i++) {
+    if(strcmp(argv[i], "-") == 0) {
+      fprintf(stderr, "error: batch conversion needs input files\n");
+      goto done;
+    }
+    batch.jobs[i].input = argv[i];
+    batch.jobs[i].output = batch_output(argv[i], outdir,
+                                        ends_with(argv[i], ".bin") ? ".conf" : ".bin");
+
+    for(int k=0; k<i; k++) {
+      if(strcmp(batch.jobs[k].output, batch.jobs[i].output) == 0) {
+        fprintf(stderr, "error: %s and %s would both be written to %s\n",
+                batch.jobs[k].input, batch.jobs[i].input, batch.jobs[i].output);
+        goto done;
+      }
+    }
+  }
+
+  jobs = batch_workers(jobs);
+  
+  for(threads=0; threads<batch.count && threads<jobs; threads++) {
+    if(pthread_create(&workers[threads], NULL, batch_worker, &batch) != 0) {
+      fprintf(stderr, "error: could not start worker thread\n");
+      break;
+    }
+  }
+
+  for(int i=0; i<threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  if(threads == 0) goto done;
+
+  // Results are reported in the order the files were given
+  for(int i=0; i<batch.count; i++) {
+    fprintf(stderr, "%s -> %s: %s\n", batch.jobs[i].input, batch.jobs[i].output,
+            batch.jobs[i].result ? "ok" : "FAILED");
+
+    if(batch.jobs[i].log != NULL) {
+      fputs(batch.jobs[i].log, stderr);
+    }
+    failed += !batch.jobs[i].result;
+  }
+  fprintf(stderr, "Converted %d of %d files\n", batch.count - failed, batch.count);
+  
+  result = (failed == 0);
+  
+ done:
+  for(int i=0; i<batch.count; i++) {
+    free(batch.jobs[i].output);
+    free(batch.jobs[i].log);
+  }
+  free(batch.jobs);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct {
+  uint8_t *image;          // the binary config, as the device reads it
+  uint16_t size;
+  const uint8_t *font;
+  uint8_t pins[NUM_PINS];  // pins combined into all states
+  uint8_t num_pins;
+  char *prefix;            // frames are written to <prefix><levels>.pgm
+  int count;
+  int next;
+  int failed;
+} Rendering;
+
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//-----------------------------------------------------------------------------
+
+static bool render_frame(Rendering *rendering, Frame *frame, uint32_t levels, char *output) {
+
+  bool result = false;
+  FILE *out = stdout;
+
+  if(!Frame_render(frame, rendering->image, rendering->size, levels, rendering->font)) {
+    fprintf(stderr, "error: could not read back the configuration\n");
+    return false;
+  }
+
+  if(strcmp(output, "-") != 0 && (out = fopen(output, "wb")) == NULL) {
+    fprintf(stderr, "%s: %s\n", output, strerror(errno));
+    return false;
+  }
+
+#if windows
+  if(out == stdout) setmode(_fileno(stdout), O_BINARY);
+#endif
+
+  result = Frame_write(frame, out);
+
+  if(out != stdout) {
+    result = (fclose(out) == 0) && result;
+  }
+  if(!result) {
+    fprintf(stderr, "%s: could not write frame\n", output);
+  }
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+static void* render_worker(void *context) {
+
+  Rendering *rendering = (Rendering *) context;
+  Frame *frame = (Frame *) malloc(sizeof(Frame));
+  char *output = (char *) calloc(strlen(rendering->prefix) + 13, sizeof(char));
+  uint32_t levels;
+  int i;
+
+  while(true) {
+    pthread_mutex_lock(&render_lock);
+    i = rendering->next++;
+    pthread_mutex_unlock(&render_lock);
+
+    if(i >= rendering->count) break;
+
+    // Bit n of the state is the level of the n-th pin combined,
+    // all other lines stay idle
+    levels = FRAME_IDLE;
+    for(uint8_t k=0; k<rendering->num_pins; k++) {
+      if(!(i & (1<<k))) levels &= ~(1UL<<rendering->pins[k]);
+    }
+    sprintf(output, "%s%08x.pgm", rendering->prefix, levels);
+
+    if(!render_frame(rendering, frame, levels, output)) {
+      pthread_mutex_lock(&render_lock);
+      rendering->failed++;
+      pthread_mutex_unlock(&render_lock);
+    }
+  }
+  free(output);
+  free(frame);
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+bool render(char *filename, char *output, char *levels, char *fontfile, int jobs) {
+
+  bool result = false;
+  Rendering rendering;
+  volatile Config *config = Config_new();
+  pthread_t workers[BATCH_MAX_WORKERS];
+  int threads = 0;
+  uint8_t *font = NULL;
+  int size = 0;
+  Frame *frame = NULL;
+  FILE *in = NULL;
+  FILE *tmp = NULL;
+  uint32_t single = 0;
+  char *end;
+  Optimization optimization;
+
+  memset(&rendering, 0, sizeof(Rendering));
+  rendering.font = _font;
+
+  if(levels != NULL) {
+    single = strtoul(levels, &end, 0);
+    if(*levels == '\0' || *end != '\0') {
+      fprintf(stderr, "error: %s: invalid pin levels\n", levels);
+      goto done;
+    }
+  }
+
+  if(fontfile != NULL) {
+    font = (uint8_t *) calloc(1, sizeof(uint8_t));
+    if(!read_file(fontfile, &font, &size)) {
+      goto done;
+    }
+    if(size != FRAME_GLYPHS*CHAR_HEIGHT) {
+      fprintf(stderr, "error: %s: font must be %d bytes\n", fontfile, FRAME_GLYPHS*CHAR_HEIGHT);
+      goto done;
+    }
+    rendering.font = font;
+  }
+
+  if((in = fopen(filename, "rb")) == NULL) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    goto done;
+  }
+
+  // Parsed configs are optimized just as they are for the device, so
+  // that the frames show what it would
+  if(!Config_read(config, in)) {
+    if(!Config_parse(config, in, filename)) {
+      goto done;
+    }
+    config = Config_optimize(config, &optimization);
+  }
+
+  // Each frame is read from the binary config, just like the device
+  // would, so that frames don't share any state
+  if((tmp = tmpfile()) == NULL) {
+    fprintf(stderr, "error: %s\n", strerror(errno));
+    goto done;
+  }
+  rendering.size = Config_write(config, tmp);
+  rendering.image = (uint8_t *) calloc(rendering.size, sizeof(uint8_t));
+  rewind(tmp);
+
+  if(fread(rendering.image, sizeof(uint8_t), rendering.size, tmp) != rendering.size) {
+    fprintf(stderr, "error: could not write the configuration\n");
+    goto done;
+  }
+
+  if(levels != NULL) {
+    frame = (Frame *) malloc(sizeof(Frame));
+    result = render_frame(&rendering, frame, single, output);
+    goto done;
+  }
+
+  // Without levels, render every state of the pins the config reads
+  rendering.num_pins = Config_get_input_pins(config, rendering.pins);
+
+  if(rendering.num_pins > RENDER_MAX_PINS) {
+    fprintf(stderr, "error: %s reads %d pins, render single states with --pins\n",
+            filename, rendering.num_pins);
+    goto done;
+  }
+  rendering.count = 1<<rendering.num_pins;
+
+  if(!batch_directory(output)) {
+    goto done;
+  }
+  rendering.prefix = batch_output(filename, output, "-");
+
+  fprintf(stderr, "Rendering %d frames for pins", rendering.count);
+  for(uint8_t i=0; i<rendering.num_pins; i++) {
+    fprintf(stderr, " %d", rendering.pins[i]);
+  }
+  fprintf(stderr, "...\n");
+
+  jobs = batch_workers(jobs);
+
+  for(threads=0; threads<rendering.count && threads<jobs; threads++) {
+    if(pthread_create(&workers[threads], NULL, render_worker, &rendering) != 0) {
+      fprintf(stderr, "error: could not start worker thread\n");
+      break;
+    }
+  }
+
+  for(int i=0; i<threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  if(threads == 0) goto done;
+
+  fprintf(stderr, "Rendered %d of %d frames to %s*.pgm\n",
+          rendering.count - rendering.failed, rendering.count, rendering.prefix);
+
+  result = (rendering.failed == 0);
+
+ done:
+  if(in != NULL) fclose(in);
+  if(tmp != NULL) fclose(tmp);
+  free(rendering.image);
+  free(rendering.prefix);
+  free(frame);
+  free(font);
   Config_free(config);
   return result;
 }
@@ -211,19 +738,35 @@ bool convert(int argc, char **argv) {
 
 bool configure(int argc, char **argv) {
 
+  Payload payload;
+  bool result = false;
+  
+  memset(&payload, 0, sizeof(Payload));
+
+  if(load_configuration((argc >= 1) ? argv[0] : "-", &payload)) {
+    result = deliver(&payload);
+  }
+  free_payload(&payload);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool load_configuration(char *filename, Payload *payload) {
+
   bool result = false;
 
   FILE *in  = stdin;
   FILE *out = NULL;
-  uint8_t *data = NULL;
-  uint16_t size = 0;
-
-  config = Config_new();
+  volatile Config *config = Config_new();
+  Optimization optimization;
+  Optimization *optimized = NULL;
+  uint16_t written;
   
-  if(argc >= 1 && (strncmp(argv[0], "-", 1) != 0)) {
+  if(strncmp(filename, "-", 1) != 0) {
 
-    if((in = fopen(argv[0], "rb")) == NULL) {
-      fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    if((in = fopen(filename, "rb")) == NULL) {
+      fprintf(stderr, "%s: %s\n", filename, strerror(errno));
       goto done;
     }
   }
@@ -234,279 +777,1542 @@ bool configure(int argc, char **argv) {
     setmode(_fileno(stdin), O_BINARY);
 #endif    
   }
+  else {
+    fprintf(stderr, "Reading %s...\n", filename);
+  }
+  
+  if(!Config_read(config, in)) {
+    if(!Config_parse_files(config, in, (in == stdin) ? NULL : filename, &payload->files)) {
+      goto done;
+    }
+    config = Config_optimize(config, &optimization);
+    optimized = &optimization;
+  }
+
+  payload->config = (uint8_t*) calloc(4096, sizeof(char));
+  payload->compat = (uint8_t*) calloc(4096, sizeof(char));
+
+  if((out = fmemopen(payload->config, 4096, "wb")) == NULL) {
+    fprintf(stderr, "error: %s\n", strerror(errno));
+    goto done;
+  }
+
+  written = Config_write(config, out);
+  payload->config_size = ftell(out);
+  fmemupdate(out, payload->config, payload->config_size);  
+  fclose(out);
+
+  if((out = fmemopen(payload->compat, 4096, "wb")) == NULL) {
+    fprintf(stderr, "error: %s\n", strerror(errno));
+    goto done;
+  }
+
+  Config_write_for(config, out, OVERLAY64_FEATURES & ~OVERLAY64_FEATURE_VIEWS);
+  payload->compat_size = ftell(out);
+  fmemupdate(out, payload->compat, payload->compat_size);
+  fclose(out);
+
+  footprint(config, written, optimized);
+  payload->required = Config_get_footprint(config);
+
+  if(payload->config_size > EEPROM_CONFIG_SIZE) {
+    fprintf(stderr, "error: configuration exceeds %d bytes of eeprom\n", EEPROM_CONFIG_SIZE);
+    goto done;
+  }
+  result = true;
+
+ done:  
+  Config_free(config);
+  if(in != NULL && in != stdin) fclose(in);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+// The firmware commits uploads to eeprom while the transfer is still
+// going on, so the transfer takes as long as writing each byte does
+
+static unsigned int eeprom_timeout(uint16_t size) {
+  return USB_TIMEOUT + size * EEPROM_WRITE_TIME;
+}
+
+//-----------------------------------------------------------------------------
+
+// Firmware that knows more than the first one did reports its features
+// in a second status byte
+
+static bool has_feature(uint8_t feature) {
+  uint8_t reply[2];
+  
+  return usb_receive(&overlay64, OVERLAY64_STATUS, 0, 0, reply, 2) == 2 &&
+    (reply[1] & feature);
+}
+
+//-----------------------------------------------------------------------------
+
+// Swaps in the config written without views for firmware that can't
+// read strings stored as views into others
+
+static bool drop_views(Payload *payload) {
+  uint8_t *config = payload->config;
+  uint16_t size = payload->config_size;
+  
+  if(payload->compat_size > EEPROM_CONFIG_SIZE) {
+    fprintf(console, "error: configuration exceeds %d bytes of eeprom for this firmware\n",
+            EEPROM_CONFIG_SIZE);
+    return false;
+  }
+  
+  payload->config = payload->compat;
+  payload->config_size = payload->compat_size;
+  payload->compat = config;
+  payload->compat_size = size;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+// Leaves the payload itself alone, so that it can be delivered to
+// several devices at once
+
+static Payload* compatible_payload(Payload *payload, Payload *copy) {
+
+  if(usb_ping(&usbasp)) {
+    reset();
+  }
+
+  if(has_feature(OVERLAY64_FEATURE_VIEWS)) {
+    return payload;
+  }
+  *copy = *payload;
+  return drop_views(copy) ? copy : NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool send_configuration(Payload *payload) {
+
+  bool result = false;
+  int tries = 5;
+  bool quiet = usb_quiet;
+  
+  if(usb_ping(&usbasp)) {
+    reset();
+  }
+    
+  fprintf(console, "Flashing configuration: %d bytes...", payload->config_size);
+  fflush(console);
+
+  usb_quiet = true;    
+
+  while(tries--) {
+    if((result = usb_send_slow(&overlay64, OVERLAY64_FLASH, payload->required, 0,
+                               payload->config, payload->config_size,
+                               eeprom_timeout(payload->config_size)) == payload->config_size)) {
+      break;
+    }
+  }
+
+  usb_quiet = quiet;
+
+  fprintf(console, result ? "ok\n" : "failed!\n");
+
+  if(result) {
+    result = activate("Activating configuration");
+  }
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool update(int argc, char **argv) {
+
+  Payload payload;
+  bool result = false;
+  
+  if(!argc) {
+    usage();
+    return false;
+  }
+
+  memset(&payload, 0, sizeof(Payload));
+  
+  if(load_firmware(argv[0], &payload) &&
+     (argc < 2 || load_configuration(argv[1], &payload))) {
+    result = deliver(&payload);
+  }
+  free_payload(&payload);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool load_firmware(char *filename, Payload *payload) {
+  bool result = false;
+
+  uint8_t *data = (uint8_t *) calloc(1, sizeof(uint8_t));
+  Segment *segments = NULL;
+  int count = 0;
+  int size = 0;
+  
+  if(!read_file(filename, &data, &size)) {
+    goto done;
+  }
+  
+  if(ends_with(filename, ".hex")) {
+    fprintf(stderr, "Trying to parse Intel HEX format..."); fflush(stderr);
+    
+    if((segments = readhex(data, size, &count)) == NULL) {
+      fprintf(stderr, "FAILED!\n");
+      errno = EINVAL;
+      goto error;
+    }
+    fprintf(stderr, "OK\n");
+    
+    for(int i=0; i<count; i++) {
+      fprintf(stderr, "Parsed %d bytes starting at 0x%02X\n",
+              segments[i].size, segments[i].address);
+    }
+  }
+  else if(ends_with(filename, ".bin")) {
+    segments = (Segment *) calloc(1, sizeof(Segment));
+    segments[0].address = 0;
+    segments[0].size = size;
+    segments[0].data = data;
+    count = 1;
+    data = NULL;
+  }
+  else {
+    fprintf(stderr, "error: please supply firmware as a .bin or .hex file\n");
+    goto done;
+  }
+
+  payload->firmware = segments;
+  payload->segments = count;
+  result = true;
+  
+ done:
+  free(data);
+  return result;
+
+ error:
+  fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+  goto done;  
+}
+
+//-----------------------------------------------------------------------------
+
+bool deliver(Payload *payload) {
+
+  bool result = true;
+  Payload compat;
+  
+  if(payload->firmware != NULL) {
+
+    // Keep the new firmware from starting up with a configuration that
+    // may not match it
+    if(payload->config != NULL) {
+      uint8_t erased[2] = { 0x00, 0x00 };
+    
+      if(!usb_ping(&overlay64)) {
+        fprintf(console, "error: could not connect to overlay64\n");
+        return false;
+      }
+    
+      fprintf(console, "Deactivating existing configuration...");
+      fflush(console);
+
+      result = usb_send(&overlay64, OVERLAY64_FLASH, 0, 0, erased, 2) == 2;
+      fprintf(console, result ? "ok\n" : "failed!\n");
+      if(!result) return false;
+
+      expect(&overlay64, "Waiting for overlay64 to reboot");
+    }
+    result = program(USBASP_WRITEFLASH, payload->firmware, payload->segments);
+  }
+
+  if(result && payload->config != NULL) {
+    result = (payload = compatible_payload(payload, &compat)) != NULL &&
+      send_configuration(payload);
+  }
+
+  if(result && payload->config != NULL && verify) {
+    result = verify_configuration(payload);
+  }
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+void free_payload(Payload *payload) {
+  free_segments(payload->firmware, payload->segments);
+  free(payload->config);
+  free(payload->compat);
+  FileList_free(&payload->files);
+  memset(payload, 0, sizeof(Payload));
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct {
+  Payload *payload;
+  Unit *units;
+  int count;
+  int next;
+  bool interactive;
+} Fleet;
+
+static void last_line(FILE *log, char *line, int size) {
+
+  char buf[256];
+  char *start;
+  
+  line[0] = '\0';
+  rewind(log);
+
+  while(fgets(buf, sizeof(buf), log) != NULL) {
+    buf[strcspn(buf, "\n")] = '\0';
+    start = strrchr(buf, '\r');
+    start = (start != NULL) ? start+1 : buf;
+
+    if(start[0] != '\0') {
+      snprintf(line, size, "%.*s", size-1, start);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+static void* fleet_worker(void *context) {
+
+  Fleet *fleet = (Fleet *) context;
+  Unit *unit;
+  bool result;
+  int i;
+
+  prepare_devices();
+  usb_quiet = true;
+  
+  while(true) {
+    pthread_mutex_lock(&fleet_lock);
+    if((i = fleet->next++) < fleet->count) {
+      fleet->units[i].state = UNIT_RUNNING;
+    }
+    pthread_mutex_unlock(&fleet_lock);
+
+    if(i >= fleet->count) break;
+
+    // Follow the board by the port it is plugged into, since it
+    // re-enumerates with a new address each time it resets
+    unit = &fleet->units[i];
+    strncpy(overlay64.port, unit->device.port, sizeof(overlay64.port));
+    strncpy(overlay64.path, unit->device.port, sizeof(overlay64.path));
+    strncpy(usbasp.port, unit->device.port, sizeof(usbasp.port));
+    strncpy(usbasp.path, unit->device.port, sizeof(usbasp.path));
+    
+    worker_unit = unit;
+    worker_log = tmpfile();
+
+    result = deliver(fleet->payload);
+
+    usb_close(&overlay64);
+    usb_close(&usbasp);
+
+    pthread_mutex_lock(&fleet_lock);
+    if(worker_log != NULL) {
+      last_line(worker_log, unit->message, sizeof(unit->message));
+      fclose(worker_log);
+    }
+    unit->state = result ? UNIT_OK : UNIT_FAILED;
+    pthread_mutex_unlock(&fleet_lock);
+
+    worker_log = NULL;
+    worker_unit = NULL;
+  }
+  
+  usb_exit();
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+static int fleet_table(Fleet *fleet) {
+
+  const char *states[] = { "waiting", "running", "ok", "FAILED" };
+  char progress[8];
+  Unit *unit;
+  int finished = 0;
+  
+  fprintf(stderr, "%-8s %-12s %-16s %-8s %-8s %s\n",
+          "Device", "Port", "Serial", "Progress", "Result", "Last message");
+  
+  for(int i=0; i<fleet->count; i++) {
+    unit = &fleet->units[i];
+
+    if(unit->total > 0) {
+      snprintf(progress, sizeof(progress), "%d%%", (int) (100L*unit->bytes/unit->total));
+    }
+    else {
+      snprintf(progress, sizeof(progress), "-");
+    }
+    
+    fprintf(stderr, "%s%-8s %-12s %-16s %-8s %-8s %s\n",
+            fleet->interactive ? "\033[K" : "",
+            unit->device.path, unit->device.port,
+            (unit->device.serial != NULL) ? unit->device.serial : "-",
+            progress, states[unit->state], unit->message);
+
+    if(unit->state == UNIT_OK || unit->state == UNIT_FAILED) {
+      finished++;
+    }
+  }
+  return finished;
+}
+
+//-----------------------------------------------------------------------------
+
+bool fleet(int argc, char **argv) {
+
+  bool result = false;
+  Payload payload;
+  Fleet fleet;
+  DeviceInfo *devices = NULL;
+  pthread_t workers[FLEET_WORKERS];
+  int threads = 0;
+  int count, more;
+  int finished;
+
+  memset(&payload, 0, sizeof(Payload));
+  memset(&fleet, 0, sizeof(Fleet));
+  
+  if(argc == 2 && strncmp(argv[0], "configure", 4) == 0) {
+    if(!load_configuration(argv[1], &payload)) goto done;
+  }
+  else if((argc == 2 || argc == 3) && strcmp(argv[0], "update") == 0) {
+    if(!load_firmware(argv[1], &payload)) goto done;
+    if(argc == 3 && !load_configuration(argv[2], &payload)) goto done;
+  }
+  else {
+    usage();
+    complain();
+    goto done;
+  }
+
+  // Boards may be running the application or still sit in the bootloader
+  devices = (DeviceInfo *) calloc(FLEET_MAX_DEVICES, sizeof(DeviceInfo));
+  
+  if((count = usb_enumerate(&overlay64, devices, FLEET_MAX_DEVICES)) < 0 ||
+     (more = usb_enumerate(&usbasp, devices+count, FLEET_MAX_DEVICES-count)) < 0) {
+    goto done;
+  }
+  count += more;
+
+  if(count == 0) {
+    fprintf(stderr, "error: no devices found\n");
+    goto done;
+  }
+  
+  fleet.payload = &payload;
+  fleet.interactive = isatty(fileno(stderr));
+  fleet.count = count;
+  fleet.units = (Unit *) calloc(count, sizeof(Unit));
+
+  for(int i=0; i<count; i++) {
+    fleet.units[i].device = devices[i];
+  }
+
+  fprintf(stderr, "Found %d device%s\n\n", count, (count == 1) ? "" : "s");
+  
+  for(threads=0; threads<count && threads<FLEET_WORKERS; threads++) {
+    if(pthread_create(&workers[threads], NULL, fleet_worker, &fleet) != 0) {
+      fprintf(stderr, "error: could not start worker thread\n");
+      break;
+    }
+  }
+
+  // Redraw the table in place while the workers are busy, when output
+  // goes to a file only print the final result
+  while(threads) {
+    pthread_mutex_lock(&fleet_lock);
+    if(fleet.interactive) {
+      finished = fleet_table(&fleet);
+    }
+    else {
+      finished = 0;
+      for(int i=0; i<count; i++) {
+        finished += fleet.units[i].state >= UNIT_OK;
+      }
+    }
+    pthread_mutex_unlock(&fleet_lock);
+
+    if(finished == count) break;
+    usleep(250000);
+    
+    if(fleet.interactive) {
+      fprintf(stderr, "\033[%dA", count+1);
+    }
+  }
+
+  for(int i=0; i<threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  if(!fleet.interactive) {
+    fleet_table(&fleet);
+  }
+  
+  result = threads > 0;
+  for(int i=0; i<count; i++) {
+    result = result && fleet.units[i].state == UNIT_OK;
+  }
+  
+ done:
+  for(int i=0; i<fleet.count; i++) {
+    free(fleet.units[i].device.serial);
+  }
+  free(fleet.units);
+  free(devices);
+  free_payload(&payload);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool font_update(char* filename) {
+  bool result = false;
+  
+  uint8_t *data = (uint8_t *) calloc(1, sizeof(uint8_t));
+  int size = 0;
+
+  if(read_file(filename, &data, &size)) {  
+    Segment font = { OFFSET, 96*8, data };
+    result = program(USBASP_WRITEFLASH, &font, 1);
+  }  
+
+  free(data);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool font_convert(char* infile, char* outfile) {
+  bool result = false;
+  int size = 0;
+  
+  uint8_t *data_in = (uint8_t*) calloc(1, sizeof(uint8_t));
+  uint8_t *data_out = (uint8_t*) calloc(1, sizeof(uint8_t));
+  
+  if((result = read_file(infile, &data_in, &size))) {
+    if(size < (256+32)*8) {
+      fprintf(stderr, "error: input file must be at least %d bytes\n", (256+32)*8);
+      goto done;
+    }
+    data_out = (uint8_t*) realloc(data_out, size);
+    memcpy(data_out, data_in, size);
+
+    memcpy(data_out, data_in + 32*8, 32*8);
+    memcpy(data_out + 32*8, data_in, 32*8);
+    memcpy(data_out + 64*8, data_in + 256*8, 32*8);
+
+    memcpy(data_out + 60*8, backspace, 8);
+    memcpy(data_out + 62*8, circumflex, 8);
+    memcpy(data_out + 63*8, underscore, 8);
+    memcpy(data_out + 64*8, backtick, 8);
+    memcpy(data_out + 91*8, left_curly, 8);
+    memcpy(data_out + 92*8, pipe_symbol, 8);
+    memcpy(data_out + 93*8, right_curly, 8);
+    memcpy(data_out + 94*8, tilde, 8);
+    memcpy(data_out + 95*8, del, 8);
+    
+    result = write_file(outfile, data_out, 96*8);
+  }
+  
+ done:
+  free(data_in);
+  free(data_out);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct {
+  const char *action;
+  const char *type;
+  int size;
+} Progress;
+
+static void show_progress(int bytes, void *context) {
+  Progress *state = (Progress *) context;
+
+  if(worker_unit != NULL) {
+    pthread_mutex_lock(&fleet_lock);
+    worker_unit->bytes = bytes;
+    worker_unit->total = state->size;
+    pthread_mutex_unlock(&fleet_lock);
+  }
+  fprintf(console, "\r%s %s: %d of %d bytes transferred...",
+          state->action, state->type, (bytes < state->size) ? bytes : state->size, state->size);
+}
+
+//-----------------------------------------------------------------------------
+
+static int add_page(UsbChunk *chunks, int count, uint8_t message, bool in,
+                    uint32_t page, uint8_t *buf, bool set_address) {
+
+  int restart = count;
+
+  // Each page is set up so that it can be repeated on its own,
+  // including the upper address word where that's necessary
+  if(set_address) {
+    chunks[count].message = USBASP_SETLONGADDRESS;
+    chunks[count].value = page & 0xffff;
+    chunks[count].index = page >> 16;
+    chunks[count].restart = restart;
+    count++;
+  }
+  
+  for(int offset=0; offset<USBASP_PAGE_SIZE; offset+=USBASP_CHUNK_SIZE) {
+    chunks[count].message = message;
+    chunks[count].value = (page+offset) & 0xffff;
+    chunks[count].buf = buf+offset;
+    chunks[count].size = USBASP_CHUNK_SIZE;
+    chunks[count].in = in;
+    chunks[count].restart = restart;
+    count++;
+  }
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+
+static int transfer_pages(uint8_t message, bool in, uint8_t *buf,
+                          uint32_t *addresses, bool *selected, int pages,
+                          Progress *state) {
+
+  UsbChunk *chunks;
+  bool spanning = pages && (addresses[0]>>16) != (addresses[pages-1]>>16);
+  int count = 0;
+  int result;
+
+  chunks = (UsbChunk *) calloc(pages*(USBASP_PAGE_SIZE/USBASP_CHUNK_SIZE+1), sizeof(UsbChunk));
+  state->size = 0;
+  
+  for(int i=0; i<pages; i++) {
+    if(selected != NULL && !selected[i]) continue;
+
+    count = add_page(chunks, count, message, in,
+                     addresses[i], buf + i*USBASP_PAGE_SIZE,
+                     count == 0 || spanning);
+    state->size += USBASP_PAGE_SIZE;
+  }
+
+  result = usb_stream(&usbasp, chunks, count, USBASP_QUEUE_DEPTH, USBASP_RETRIES,
+                      show_progress, state);
+  free(chunks);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+static uint32_t crc32(uint8_t *data, int size) {
+
+  uint32_t crc = 0xffffffff;
+
+  for(int i=0; i<size; i++) {
+    crc ^= data[i];
+    for(int bit=0; bit<8; bit++) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+//-----------------------------------------------------------------------------
+
+bool program(int command, Segment *segments, int count)  {
+
+  Progress state;
+  uint32_t *addresses = NULL;
+  bool *dirty = NULL;
+  uint8_t *current = NULL;
+  uint8_t *image = NULL;
+  uint32_t page;
+  uint32_t expected, actual;
+  int pages = 0;
+  int length;
+  int changed = 0;
+  int bad;
+  double elapsed;
+  double start;
+  bool result = false;
+  
+  state.type = (segments[0].address == OFFSET) ? "font" : "application";
+  
+  if(!boot()) {
+    failed(&usbasp);
+    return false;
+  }
+
+  // Collect the flash pages touched by any of the segments, which come
+  // sorted by address, and leave out whatever lies in between them
+  for(int i=0; i<count; i++) {
+    addresses = (uint32_t *) realloc(addresses, (pages + segments[i].size/USBASP_PAGE_SIZE + 2) * sizeof(uint32_t));
+    
+    for(page = segments[i].address & ~(USBASP_PAGE_SIZE-1);
+        page < segments[i].address + segments[i].size;
+        page += USBASP_PAGE_SIZE) {
+      if(pages == 0 || addresses[pages-1] != page) {
+        addresses[pages++] = page;
+      }
+    }
+  }
+
+  length = pages * USBASP_PAGE_SIZE;
+  current = (uint8_t *) malloc(length);
+  image = (uint8_t *) malloc(length);
+  dirty = (bool *) calloc(pages, sizeof(bool));
+  
+  usb_control(&usbasp, USBASP_CONNECT);
+
+  // Read back what's in flash first, so that only pages that differ
+  // have to be erased and written, and so that pages only partially
+  // covered by the image keep the rest of their contents
+  state.action = "Reading";
+  
+  if(transfer_pages(USBASP_READFLASH, true, current, addresses, NULL, pages, &state) < 0) {
+    fprintf(console, "\nwarning: could not read back flash, rewriting all pages\n");
+    memset(current, 0xff, length);
+    memset(dirty, true, pages);
+  }
+  else {
+    fprintf(console, "OK\n");
+  }
+
+  memcpy(image, current, length);
+
+  for(int i=0, p=0; i<count; i++) {
+    for(uint32_t a=segments[i].address; a<segments[i].address+segments[i].size; a++) {
+      while(addresses[p] + USBASP_PAGE_SIZE <= a) p++;
+      image[p*USBASP_PAGE_SIZE + (a - addresses[p])] = segments[i].data[a - segments[i].address];
+    }
+  }
+
+  for(int i=0; i<pages; i++) {
+    dirty[i] = dirty[i] || memcmp(image + i*USBASP_PAGE_SIZE,
+                                  current + i*USBASP_PAGE_SIZE, USBASP_PAGE_SIZE) != 0;
+    changed += dirty[i];
+  }
+
+  if(!changed) {
+    fprintf(console, "Updating %s: all %d pages up to date\n", state.type, pages);
+    result = true;
+    goto done;
+  }
+
+  for(int attempt=0; ; attempt++) {
+
+    state.action = "Updating";
+    start = seconds();
+  
+    if(transfer_pages(command, false, image, addresses, dirty, pages, &state) < 0) {
+      goto done;
+    }
+
+    elapsed = seconds() - start;
+    fprintf(console, "OK (%d of %d pages, %.2fs, %.0f bytes/s)\n",
+            state.size/USBASP_PAGE_SIZE, pages, elapsed, state.size/elapsed);
+
+    if(!verify) break;
+
+    // Read the pages just written back and compare their checksums,
+    // anything that doesn't match gets written once more
+    state.action = "Verifying";
+    
+    if(transfer_pages(USBASP_READFLASH, true, current, addresses, dirty, pages, &state) < 0) {
+      goto done;
+    }
+    fprintf(console, "OK\n");
+
+    bad = 0;
+    for(int i=0; i<pages; i++) {
+      if(!dirty[i]) continue;
+
+      expected = crc32(image + i*USBASP_PAGE_SIZE, USBASP_PAGE_SIZE);
+      actual = crc32(current + i*USBASP_PAGE_SIZE, USBASP_PAGE_SIZE);
+
+      if(expected == actual) {
+        dirty[i] = false;
+        continue;
+      }
+      fprintf(console, "Page 0x%05X: CRC32 %08X, expected %08X\n",
+              addresses[i], actual, expected);
+      bad++;
+    }
+
+    if(!bad) {
+      fprintf(console, "Verified %d pages\n", changed);
+      break;
+    }
+    
+    if(attempt == USBASP_RETRIES) {
+      fprintf(console, "error: %d pages failed to verify\n", bad);
+      goto done;
+    }
+  }
+  result = true;
+  
+ done:
+  usb_quiet = true;  
+  usb_control(&usbasp, USBASP_DISCONNECT);
+  
+  free(addresses);
+  free(dirty);
+  free(current);
+  free(image);
+  return result && expect(&overlay64, "Resetting device");
+}
+
+//-----------------------------------------------------------------------------
+
+// Streams the selected blocks of the config in eeprom, USBASP_CHUNK_SIZE
+// bytes each
+
+static int transfer_blocks(uint8_t message, bool in, uint8_t *buf, int size,
+                           bool *selected, Progress *state) {
+
+  UsbChunk *chunks;
+  int count = 0;
+  int result;
+
+  chunks = (UsbChunk *) calloc(size/USBASP_CHUNK_SIZE+1, sizeof(UsbChunk));
+  state->size = 0;
+
+  for(int i=0, offset=0; offset<size; i++, offset+=USBASP_CHUNK_SIZE) {
+    if(!selected[i]) continue;
+
+    chunks[count].message = message;
+    chunks[count].value = offset;
+    chunks[count].buf = buf+offset;
+    chunks[count].size = (size-offset < USBASP_CHUNK_SIZE) ? size-offset : USBASP_CHUNK_SIZE;
+    chunks[count].in = in;
+    chunks[count].restart = count;
+    state->size += chunks[count].size;
+    count++;
+  }
+
+  result = usb_stream(&usbasp, chunks, count, USBASP_QUEUE_DEPTH, USBASP_RETRIES,
+                      show_progress, state);
+  free(chunks);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool verify_configuration(Payload *payload) {
+
+  Progress state = { "Verifying", "configuration", payload->config_size };
+  int blocks = (payload->config_size + USBASP_CHUNK_SIZE-1) / USBASP_CHUNK_SIZE;
+  bool *dirty;
+  uint8_t *current;
+  uint32_t expected, actual;
+  int offset, len;
+  int bad;
+  bool result = false;
+
+  // The application can't read its eeprom back, so this takes a trip
+  // through the bootloader
+  if(!boot()) {
+    failed(&usbasp);
+    return false;
+  }
+
+  dirty = (bool *) malloc(blocks * sizeof(bool));
+  current = (uint8_t *) malloc(payload->config_size);
+  memset(dirty, true, blocks);
+
+  usb_control(&usbasp, USBASP_CONNECT);
+
+  for(int attempt=0; ; attempt++) {
+
+    // Read the blocks back and compare their checksums, anything that
+    // doesn't match gets written once more
+    state.action = "Verifying";
+
+    if(transfer_blocks(USBASP_READEEPROM, true, current, payload->config_size,
+                       dirty, &state) < 0) {
+      goto done;
+    }
+    fprintf(console, "OK\n");
+
+    bad = 0;
+    for(int i=0; i<blocks; i++) {
+      if(!dirty[i]) continue;
+
+      offset = i*USBASP_CHUNK_SIZE;
+      len = (payload->config_size-offset < USBASP_CHUNK_SIZE) ?
+        payload->config_size-offset : USBASP_CHUNK_SIZE;
+
+      expected = crc32(payload->config + offset, len);
+      actual = crc32(current + offset, len);
+
+      if(expected == actual) {
+        dirty[i] = false;
+        continue;
+      }
+      fprintf(console, "Block 0x%03X: CRC32 %08X, expected %08X\n",
+              offset, actual, expected);
+      bad++;
+    }
+
+    if(!bad) {
+      fprintf(console, "Verified %d bytes\n", payload->config_size);
+      break;
+    }
+
+    if(attempt == USBASP_RETRIES) {
+      fprintf(console, "error: %d blocks failed to verify\n", bad);
+      goto done;
+    }
+
+    state.action = "Rewriting";
+
+    if(transfer_blocks(USBASP_WRITEEEPROM, false, payload->config, payload->config_size,
+                       dirty, &state) < 0) {
+      goto done;
+    }
+    fprintf(console, "OK\n");
+  }
+  result = true;
+
+ done:
+  usb_quiet = true;
+  usb_control(&usbasp, USBASP_DISCONNECT);
+
+  free(dirty);
+  free(current);
+  return expect(&overlay64, "Resetting device") && result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool boot(void) {
+  if(usb_ping(&usbasp)) {
+    fprintf(console, "Device already in bootloader mode\n");
+    return true;
+  }
+  
+  if(!usb_ping(&overlay64)) {
+    failed(&overlay64);
+    return false;
+  }    
+  int tries = 5;
+  bool quiet = usb_quiet;
+
+  usb_quiet = true;
+  
+  while(tries--) {
+    if(usb_control(&overlay64, OVERLAY64_BOOT) >= 0) {
+      break;
+    }
+  }
+
+  usb_quiet = quiet;
+
+  return expect(&usbasp, "Entering bootloader");
+}
+
+//-----------------------------------------------------------------------------
+
+bool expect(DeviceInfo *device, const char* message) {
+
+  fprintf(console, "%s...", message); fflush(console);
+  
+  usb_quiet = true;
+
+  if(!usb_wait(device, 10000)) {
+    fprintf(console, "timeout!\n");
+    return false;
+  }
+  
+  fprintf(console, "\n");
+  identify();
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool activate(const char* message) {
+
+  uint8_t status;
+  int tries = 500;
+  bool quiet = usb_quiet;
+  
+  fprintf(console, "%s...", message); fflush(console);
+
+  usb_quiet = true;
+
+  // Firmware that reloads its configuration in place reports when it's
+  // done, older firmware or a config too large to be loaded next to the
+  // current one will reset the device instead
+  while(tries--) {
+    if(usb_receive(&overlay64, OVERLAY64_STATUS, 0, 0, &status, 1) != 1) {
+      break;
+    }
+    if(status == OVERLAY64_STATUS_READY) {
+      usb_quiet = quiet;
+      fprintf(console, "ok\n");
+      return true;
+    }
+    if(status == OVERLAY64_STATUS_RESET) {
+      break;
+    }
+    usleep(10000);
+  }
+  usb_quiet = quiet;
+
+  // Still writing or loading after five seconds, it won't be resetting
+  // either, so there's nothing to wait for
+  if(tries < 0) {
+    fprintf(console, "failed!\n");
+    fprintf(console, "error: device still busy\n");
+    return false;
+  }
+
+  fprintf(console, "\n");
+  return expect(&overlay64, "Resetting device");
+}
+
+//-----------------------------------------------------------------------------
+
+bool write_text(int argc, char **argv) {
+
+  TextUpdate update;
+  char *end;
+  
+  update.row = strtol(argv[0], &end, 0);
+  if(end == argv[0]) goto usage;
+  
+  update.col = strtol(argv[1], &end, 0);
+  if(end == argv[1]) goto usage;
+
+  update.text = argv[2];
+
+  if(!usb_ping(&overlay64)) {
+    failed(&overlay64);
+    return false;
+  }
+  return usb_write_text(&overlay64, OVERLAY64_WRITE, &update, 1) == 1;
+
+ usage:
+  fprintf(console, "error: row and column must be numbers\n");
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+
+bool input(int argc, char **argv) {
+
+  int first = NUM_PINS - NUM_VIRTUAL_PINS;
+  int pin, level;
+  uint8_t mask;
+  char *end;
+
+  pin = strtol(argv[0], &end, 0);
+  
+  if(end == argv[0] || pin < first || pin >= NUM_PINS) {
+    fprintf(console, "error: virtual input pin must be in the range %d-%d\n", first, NUM_PINS-1);
+    return false;
+  }
+
+  level = strtol(argv[1], &end, 0);
+
+  if(end == argv[1] || level < 0 || level > 1) {
+    fprintf(console, "error: input level must be 0 or 1\n");
+    return false;
+  }
+
+  if(!usb_ping(&overlay64)) {
+    failed(&overlay64);
+    return false;
+  }
+
+  mask = 1<<(pin-first);
+  return usb_send(&overlay64, OVERLAY64_INPUT, (mask<<8) | (level ? mask : 0), 0, NULL, 0) >= 0;
+}
+
+//-----------------------------------------------------------------------------
+
+static volatile bool monitoring;
+
+static void stop_monitoring(int signal) {
+  monitoring = false;
+}
+
+static bool print_event(uint8_t *buf, int len, void *context) {
+
+  FILE *out = (FILE *) context;
+  Event *event = (Event *) buf;
+  
+  if(!monitoring) return false;
+  if(len != sizeof(Event)) return true;
+
+  if(event->dropped) {
+    fprintf(console, "warning: %d events dropped\n", event->dropped);
+  }
+  
+  printf("frame %5d line %3d: pin %2d %s\n",
+         event->frame, event->scanline, event->pin, event->level ? "high" : "low");
+  fflush(stdout);
+  
+  if(out != NULL) {
+    fprintf(out, "%d,%d,%d,%d,%d\n",
+            event->frame, event->scanline, event->pin, event->level, event->dropped);
+  }
+  return true;
+}
+
+bool monitor(int argc, char **argv) {
+
+  bool result = false;
+  FILE *out = NULL;
+  uint8_t buf[8];
+  
+  if(argc >= 1) {
+    if((out = fopen(argv[0], "w")) == NULL) {
+      fprintf(console, "%s: %s\n", argv[0], strerror(errno));
+      return false;
+    }
+    fprintf(out, "frame,scanline,pin,level,dropped\n");
+  }
+  
+  if(!usb_ping(&overlay64)) {
+    failed(&overlay64);
+    goto done;
+  }
+
+  monitoring = true;
+  signal(SIGINT, stop_monitoring);
+  
+  fprintf(console, "Monitoring input lines, press Ctrl-C to stop...\n");
+  
+  result = usb_listen(&overlay64, OVERLAY64_EVENT_ENDPOINT,
+                      buf, sizeof(buf), print_event, out) >= 0;
+ done:
+  if(out != NULL) fclose(out);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+static volatile bool watching;
+
+static void stop_watching(int signal) {
+  watching = false;
+}
+
+//-----------------------------------------------------------------------------
+
+static const char* base_name(const char *path) {
+  const char *base = path;
+
+  for(const char *c = path; *c; c++) {
+    if(*c == '/' || *c == '\\') base = c+1;
+  }
+  return base;
+}
 
-  fprintf(stderr, "Reading %s...\n", argv[0]);
-  
-  if(Config_read(config, in) || Config_parse(config, in)) {
+//-----------------------------------------------------------------------------
 
-    data = (uint8_t*) calloc(4096, sizeof(char));
-  
-    if((out = fmemopen(data, 4096, "wb")) == NULL) {
-      fprintf(stderr, "error: %s\n", strerror(errno));
-      goto done;
-    }
-  
-    Config_write(config, out);
-    size = ftell(out);
-    fmemupdate(out, data, size);  
-    fclose(out);
+// The files a config has been read from, watched from before it is
+// first loaded until the watch ends, so that nothing saved while the
+// config is being rebuilt and pushed gets lost
 
-    footprint(config);
+typedef struct {
+  int fd;          // inotify instance, -1 where it's missing
+  FileList files;
+  int *watches;    // inotify watch on the directory of each file...
+  time_t *mtimes;  // ...or its state when last looked at
+  off_t *sizes;
+} Watcher;
 
-    if(usb_ping(&usbasp)) {
-      reset();
-    }
-    
-    fprintf(stderr, "Flashing configuration: %d bytes...", size);
-    fflush(stderr);
+//-----------------------------------------------------------------------------
+
+static void watcher_open(Watcher *self) {
+  memset(self, 0, sizeof(Watcher));
+#if linux
+  self->fd = inotify_init();
+#else
+  self->fd = -1;
+#endif
+}
 
-    int tries = 5;
-    bool quiet = usb_quiet;
+//-----------------------------------------------------------------------------
 
-    usb_quiet = true;    
+static void watcher_stat(Watcher *self, int i) {
+  struct stat st;
 
-    while(tries--) {
-      if((result = usb_send(&overlay64, OVERLAY64_FLASH, 0, 0, data, size) == size)) {
-        break;
-      }
-    }
+  self->mtimes[i] = (stat(self->files.names[i], &st) == 0) ? st.st_mtime : 0;
+  self->sizes[i] = (self->mtimes[i] != 0) ? st.st_size : -1;
+}
+
+//-----------------------------------------------------------------------------
 
-    usb_quiet = quiet;
+static void watcher_update(Watcher *self, FileList *files) {
 
-    fprintf(stderr, result ? "ok\n" : "failed!\n");
+  Watcher previous = *self;
+  bool same = files->count == self->files.count;
 
-    if(result) {
-      result = expect(&overlay64, "Resetting device");
+  for(int i=0; i<files->count && same; i++) {
+    same = strcmp(files->names[i], self->files.names[i]) == 0;
+  }
+  if(same) return;
+
+  // The includes have changed. Watching a directory once more keeps
+  // its watch as it is, and whatever is known about files that were
+  // watched before is kept as well.
+  memset(&self->files, 0, sizeof(FileList));
+  self->watches = (int *) calloc(files->count, sizeof(int));
+  self->mtimes = (time_t *) calloc(files->count, sizeof(time_t));
+  self->sizes = (off_t *) calloc(files->count, sizeof(off_t));
+
+  for(int i=0; i<files->count; i++) {
+    FileList_add(&self->files, files->names[i]);
+    watcher_stat(self, i);
+
+    for(int k=0; k<previous.files.count; k++) {
+      if(strcmp(previous.files.names[k], files->names[i]) == 0) {
+        self->mtimes[i] = previous.mtimes[k];
+        self->sizes[i] = previous.sizes[k];
+      }
+    }
+#if linux
+    // Editors either rewrite a file in place or move a new one over it,
+    // so the directories are watched rather than the files themselves
+    if(self->fd >= 0) {
+      char dir[4096];
+      int len = base_name(files->names[i]) - files->names[i];
+      
+      snprintf(dir, sizeof(dir), "%.*s", len ? len : 1, len ? files->names[i] : ".");
+      self->watches[i] = inotify_add_watch(self->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
     }
+#endif
   }
 
- done:  
-  Config_free(config);
-  fclose(in);
-
-  if(data != NULL) free(data);
-  return result;
+  FileList_free(&previous.files);
+  free(previous.watches);
+  free(previous.mtimes);
+  free(previous.sizes);
 }
 
 //-----------------------------------------------------------------------------
 
-static bool ends_with(const char *str, const char *end) {
-  if(str == NULL || end == NULL) return false;
-  if(strlen(end) > strlen(str)) return false;
-  return strncasecmp(str+strlen(str)-strlen(end), end, strlen(end)) == 0;
+static void watcher_close(Watcher *self) {
+  if(self->fd >= 0) close(self->fd);
+  FileList_free(&self->files);
+  free(self->watches);
+  free(self->mtimes);
+  free(self->sizes);
 }
 
 //-----------------------------------------------------------------------------
 
-bool update(int argc, char **argv) {
-  bool result = false;
-
-  char *filename = argv[0];
-  unsigned int address = 0;  
-  uint8_t *data = (uint8_t *) calloc(1, sizeof(uint8_t));
-  int size = 0;
-  
-  if(!argc) {
-    usage();
-    goto done;
-  }
-  
-  if(!(result = read_file(filename, &data, &size))) {
-    goto done;
-  }
+static bool wait_polling(Watcher *self) {
+  struct stat st;
   
-  if(ends_with(filename, ".hex")) {
-    fprintf(stderr, "Trying to parse Intel HEX format..."); fflush(stderr);
-    
-    data = readhex(data, &size, &address);
-
-    if(!data) {
-      fprintf(stderr, "FAILED!\n");
-      errno = EINVAL;
-      goto error;
+  while(watching) {
+    for(int i=0; i<self->files.count; i++) {
+      if(stat(self->files.names[i], &st) != 0) continue;
+      
+      if(st.st_mtime != self->mtimes[i] || st.st_size != self->sizes[i]) {
+        usleep(WATCH_SETTLE*1000);
+
+        // Anything saved from here on counts as the next change
+        for(int k=0; k<self->files.count; k++) {
+          watcher_stat(self, k);
+        }
+        return watching;
+      }
     }
-    fprintf(stderr, "OK\nParsed %d bytes starting at 0x%02X\n", size, address);
-  }
-  else if(!ends_with(filename, ".bin")) {
-    fprintf(stderr, "error: please supply firmware as a .bin or .hex file\n");
-    goto done;
+    usleep(WATCH_INTERVAL*1000);
   }
+  return false;
+}
 
-  if(argc == 2) {
-    uint8_t erased[2] = { 0x00, 0x00 };
-    
-    if(!usb_ping(&overlay64)) {
-      fprintf(stderr, "error: could not connect to overlay64\n");
-      goto done;
-    }
-    
-    fprintf(stderr, "Deactivating existing configuration...");
-    fflush(stderr);
-
-    result = usb_send(&overlay64, OVERLAY64_FLASH, 0, 0, erased, 2) == 2;
-    fprintf(stderr, result ? "ok\n" : "failed!\n");
-    if(!result) goto done;
+//-----------------------------------------------------------------------------
 
-    expect(&overlay64, "Waiting for overlay64 to reboot");
+static bool wait_for_change(Watcher *self) {
+#if linux
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  struct pollfd pfd = { self->fd, POLLIN, 0 };
+  bool changed = false;
+  int len;
+
+  if(self->fd < 0) {
+    return wait_polling(self);
   }
-  
-  if((result = program(USBASP_WRITEFLASH, data, size, address))) {
 
-    if(argc == 2) {
-      argc--; argv++;
-      result = configure(argc, argv);
+  // Saving often takes several writes, wait for them to settle. Events
+  // that came in while the last change was pushed are still queued.
+  while(watching) {
+    if((len = poll(&pfd, 1, changed ? WATCH_SETTLE : 500)) < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    if(len == 0) {
+      if(changed) break;
+      continue;
+    }
+    if((len = read(self->fd, buf, sizeof(buf))) <= 0) {
+      break;
+    }
+    for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+      event = (struct inotify_event *) p;
+      
+      for(int i=0; i<self->files.count && event->len; i++) {
+        if(event->wd == self->watches[i] &&
+           strcmp(event->name, base_name(self->files.names[i])) == 0) {
+          changed = true;
+        }
+      }
     }
   }
-  
- done:
-  free(data);
-  return result;
-
- error:
-  fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
-  goto done;  
+  return changed && watching;
+#else
+  return wait_polling(self);
+#endif
 }
 
 //-----------------------------------------------------------------------------
 
-bool font_update(char* filename) {
+static bool push_changes(Payload *payload, uint8_t *image, uint16_t size, bool patch) {
+
   bool result = false;
-  
-  uint8_t *data = (uint8_t *) calloc(1, sizeof(uint8_t));
-  int size = 0;
+  int tries = 5;
+  bool quiet = usb_quiet;
+  int first = -1, last = -1;
+  uint16_t len;
+
+  // Whatever lies beyond the end of the new config is never read, so
+  // only the bytes up to there are compared against the last image
+  for(int i=0; i<payload->config_size; i++) {
+    if(i >= size || payload->config[i] != image[i]) {
+      if(first < 0) first = i;
+      last = i;
+    }
+  }
 
-  if(read_file(filename, &data, &size)) {  
-    result = program(USBASP_WRITEFLASH, data, 96*8, OFFSET);
-  }  
+  // Older firmware only takes complete configs, and the magic always
+  // goes through a full upload
+  if(!patch || image == NULL || first < 2) {
+    return send_configuration(payload);
+  }
 
-  free(data);
-  return result;
-}
+  len = last - first + 1;
+  
+  fprintf(console, "Patching configuration: %d bytes at %d...", len, first);
+  fflush(console);
 
-//-----------------------------------------------------------------------------
+  usb_quiet = true;
 
-bool font_convert(char* infile, char* outfile) {
-  bool result = false;
-  int size = 0;
-  
-  uint8_t *data_in = (uint8_t*) calloc(1, sizeof(uint8_t));
-  uint8_t *data_out = (uint8_t*) calloc(1, sizeof(uint8_t));
-  
-  if((result = read_file(infile, &data_in, &size))) {
-    if(size < (256+32)*8) {
-      fprintf(stderr, "error: input file must be at least %d bytes\n", (256+32)*8);
-      goto done;
+  while(tries--) {
+    if((result = usb_send_slow(&overlay64, OVERLAY64_PATCH, payload->required, first,
+                               payload->config + first, len, eeprom_timeout(len)) == len)) {
+      break;
     }
-    data_out = (uint8_t*) realloc(data_out, size);
-    memcpy(data_out, data_in, size);
+  }
 
-    memcpy(data_out, data_in + 32*8, 32*8);
-    memcpy(data_out + 32*8, data_in, 32*8);
-    memcpy(data_out + 64*8, data_in + 256*8, 32*8);
+  usb_quiet = quiet;
 
-    memcpy(data_out + 60*8, backspace, 8);
-    memcpy(data_out + 62*8, circumflex, 8);
-    memcpy(data_out + 63*8, underscore, 8);
-    memcpy(data_out + 64*8, backtick, 8);
-    memcpy(data_out + 91*8, left_curly, 8);
-    memcpy(data_out + 92*8, pipe_symbol, 8);
-    memcpy(data_out + 93*8, right_curly, 8);
-    memcpy(data_out + 94*8, tilde, 8);
-    memcpy(data_out + 95*8, del, 8);
-    
-    result = write_file(outfile, data_out, 96*8);
+  fprintf(console, result ? "ok\n" : "failed!\n");
+
+  if(result) {
+    result = activate("Activating changes");
   }
-  
- done:
-  free(data_in);
-  free(data_out);
   return result;
 }
 
 //-----------------------------------------------------------------------------
 
-bool program(int command, uint8_t *data, int size, unsigned int address)  {
-
-  const char *type = (command == USBASP_WRITEEEPROM) ?
-    "configuration" :
-    (address == OFFSET) ? "font" : "application";
-
-  if(boot()) {
-    usb_control(&usbasp, USBASP_CONNECT);
-    
-    for(uint32_t i=0; i<size+64; i+=64) {
-      usb_send(&usbasp, command,
-               (uint16_t) (address & 0xffff), (uint16_t) (address>>16),
-               data+i, 64);
-      address+=64;
-      fprintf(stderr, "\rUpdating %s: %d of %d bytes transferred...",
-              type, (i<size) ? i : size , size);
-    }
-    fprintf(stderr, "OK\n");
+bool watch(char *filename) {
 
-    usb_quiet = true;  
-    usb_control(&usbasp, USBASP_DISCONNECT);
+  Payload payload;
+  uint8_t *image = NULL; // as last pushed to the device
+  uint16_t size = 0;
+  Watcher watcher;
+  bool patch;
+  bool views;
+  double start;
+  
+  if(strcmp(filename, "-") == 0) {
+    fprintf(stderr, "error: can't watch standard input\n");
+    return false;
   }
-  else {
-    failed(&usbasp);
+
+  if(!usb_ping(&overlay64)) {
+    failed(&overlay64);
     return false;
   }
-  return expect(&overlay64, "Resetting device");
-}
 
-//-----------------------------------------------------------------------------
+  patch = has_feature(OVERLAY64_FEATURE_PATCH);
+  views = has_feature(OVERLAY64_FEATURE_VIEWS);
 
-bool boot(void) {
-  if(usb_ping(&usbasp)) {
-    fprintf(stderr, "Device already in bootloader mode\n");
-    return true;
+  if(!patch) {
+    fprintf(stderr, "Firmware can't apply partial updates, sending complete configurations\n");
   }
   
-  if(!usb_ping(&overlay64)) {
-    failed(&overlay64);
-    return false;
-  }    
-  int tries = 5;
-  bool quiet = usb_quiet;
+  memset(&payload, 0, sizeof(Payload));
 
-  usb_quiet = true;
+  // Watch the config from the start, before it is read for the first time
+  watcher_open(&watcher);
+  FileList_add(&payload.files, filename);
+  watcher_update(&watcher, &payload.files);
   
-  while(tries--) {
-    if(usb_control(&overlay64, OVERLAY64_BOOT) >= 0) {
+  watching = true;
+  signal(SIGINT, stop_watching);
+
+  start = seconds();
+  
+  while(watching) {
+    if(load_configuration(filename, &payload) &&
+       (views || drop_views(&payload))) {
+
+      if(image != NULL && payload.config_size == size &&
+         memcmp(payload.config, image, size) == 0) {
+        fprintf(stderr, "Configuration unchanged\n");
+      }
+      else if(push_changes(&payload, image, size, patch)) {
+        free(image);
+        image = payload.config;
+        size = payload.config_size;
+        payload.config = NULL;
+        
+        fprintf(stderr, "Updated in %.0f ms\n", (seconds() - start) * 1000);
+      }
+      else {
+        // No telling what the device holds now
+        free(image);
+        image = NULL;
+        size = 0;
+      }
+    }
+
+    if(payload.files.count == 0) {
+      FileList_add(&payload.files, filename);
+    }
+    
+    watcher_update(&watcher, &payload.files);
+    
+    fprintf(stderr, "Watching %d file%s for changes, press Ctrl-C to stop...\n",
+            payload.files.count, payload.files.count == 1 ? "" : "s");
+
+    if(!wait_for_change(&watcher)) {
       break;
     }
+    start = seconds();
+    free_payload(&payload);
   }
 
-  usb_quiet = quiet;
-
-  return expect(&usbasp, "Entering bootloader");
+  watcher_close(&watcher);
+  free_payload(&payload);
+  free(image);
+  return true;
 }
 
 //-----------------------------------------------------------------------------
 
-bool expect(DeviceInfo *device, const char* message) {
+bool benchmark(void) {
 
-  fprintf(stderr, "%s", message); fflush(stderr);
-  
-  uint8_t tries = 10;
-  usb_quiet = true;
+  char text[SCREEN_COLUMNS+1];
+  TextUpdate update = { 0, 0, text };
+  double start, elapsed;
+  int updates = 0;
+
+  if(!usb_ping(&overlay64)) {
+    failed(&overlay64);
+    return false;
+  }
+
+  fprintf(stderr, "Writing live text to row 0 for 5 seconds..."); fflush(stderr);
   
-  do {     
-    sleep(1);
-    fprintf(stderr, "."); fflush(stderr);
+  start = seconds();
+  do {
+    snprintf(text, sizeof(text), "UPDATE %08d", updates);
     
-    if(!--tries) {
+    if(usb_write_text(&overlay64, OVERLAY64_WRITE, &update, 1) != 1) {
+      fprintf(stderr, "failed!\n");
       return false;
     }
-  } while(!usb_ping(device));
+    updates++;
+    
+    elapsed = seconds() - start;
+  } while(elapsed < 5.0);
   
-  fprintf(stderr, "\n");
-  identify();
+  fprintf(stderr, "ok\n");
+  fprintf(stderr, "%d updates in %.2f seconds (%.1f updates/s)\n",
+          updates, elapsed, updates / elapsed);
+  
+  update.text = "";
+  usb_write_text(&overlay64, OVERLAY64_WRITE, &update, 1);
   return true;
 }
 
 //-----------------------------------------------------------------------------
 
+bool benchmark_parse(char *filename) {
+
+  uint8_t *data = (uint8_t *) calloc(1, sizeof(uint8_t));
+  double start, elapsed;
+  unsigned long allocations = Arena_allocations;
+  unsigned long blocks = Arena_blocks;
+  int size = 0;
+  int parses = 0;
+  bool result = false;
+  FILE *in;
+  volatile Config *config;
+
+  if(!read_file(filename, &data, &size)) {
+    goto done;
+  }
+
+  fprintf(stderr, "Parsing %s for 5 seconds...", filename); fflush(stderr);
+
+  // Parse from memory, so that only the parser itself is measured
+  start = seconds();
+  do {
+    if((in = fmemopen(data, size, "rb")) == NULL) {
+      fprintf(stderr, "error: %s\n", strerror(errno));
+      goto done;
+    }
+    
+    config = Config_new();
+    result = Config_parse(config, in, filename);
+    Config_free(config);
+    fclose(in);
+
+    if(!result) {
+      fprintf(stderr, "failed!\n");
+      goto done;
+    }
+    parses++;
+
+    elapsed = seconds() - start;
+  } while(elapsed < 5.0);
+
+  fprintf(stderr, "ok\n");
+  fprintf(stderr, "%d parses in %.2f seconds (%.3f ms/parse, %.1f MB/s)\n",
+          parses, elapsed, elapsed * 1000 / parses,
+          (double) size * parses / elapsed / (1024*1024));
+  fprintf(stderr, "%lu allocations from %lu arena blocks per parse\n",
+          (Arena_allocations - allocations) / parses, (Arena_blocks - blocks) / parses);
+
+ done:
+  free(data);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
 bool reset(void) {
   
   if(usb_ping(&overlay64)) {
@@ -532,12 +2338,12 @@ bool identify(void) {
 
   if(usb_ping(&overlay64)) {  
     if(usb_receive(&overlay64, OVERLAY64_IDENTIFY, 0, 0, (uint8_t*) id, 64) > 0) {
-      printf("%s\n", id);
+      fprintf(worker_log != NULL ? worker_log : stdout, "%s\n", id);
       return true;
     }
   }
   else if(usb_ping(&usbasp)) {
-    fprintf(stderr, "USBaspLoader (C)2008 by OBJECTIVE DEVELOPMENT Software GmbH\n");
+    fprintf(console, "USBaspLoader (C)2008 by OBJECTIVE DEVELOPMENT Software GmbH\n");
     return true;
   } 
   else {
@@ -567,6 +2373,13 @@ void prepare_devices(void) {
 
 //-----------------------------------------------------------------------------
 
+bool is_dir(const char* path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+//-----------------------------------------------------------------------------
+
 bool is_file(const char* path) {
   FILE *in = NULL;
   
@@ -673,15 +2486,53 @@ void fmemupdate(FILE *fp, void *buf,  uint16_t size) {
 
 //-----------------------------------------------------------------------------
 
-void footprint(volatile Config* config) {
+double seconds(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+//-----------------------------------------------------------------------------
+
+void footprint(volatile Config* config, uint16_t written, Optimization* optimized) {
 
-  uint16_t footprint = Config_get_footprint(config);
+  HeapUsage heap;
+  int used;
+  int removed;
 
-  fprintf(stderr, "SRAM:\t%5d of 16384 bytes used (%5d bytes free)\n",
-          footprint, 16384-footprint);
-  
-  fprintf(stderr, "EEPROM:\t%5d of  4096 bytes used (%5d bytes free)\n",
+  if(Config_get_heap_usage(config, &heap)) {
+    used = HEAP_STATIC + heap.peak;
+
+    fprintf(console, "SRAM:\t%5d of 16384 bytes used (%5d bytes free)\n",
+            used, HEAP_SRAM_SIZE-used);
+
+    fprintf(console, "Heap:\t%5d bytes at peak, %d bytes left in %d free chunks\n",
+            heap.peak, heap.wasted, heap.holes);
+
+    fprintf(console, "Live:\t%5d bytes more with live text in every row\n", heap.live);
+
+    fprintf(console, "Stack:\t%5d bytes headroom (%d bytes with all interrupts nested)\n",
+            heap.headroom, heap.slack);
+
+    if(!heap.fits) {
+      fprintf(stderr, "warning: configuration does not fit into SRAM\n");
+    }
+  }
+
+  fprintf(console, "EEPROM:\t%5d of  4096 bytes used (%5d bytes free)\n",
           written, 4096-written);    
+
+  if(optimized == NULL) {
+    return;
+  }
+  removed = optimized->hoisted + optimized->shadowed + optimized->merged + optimized->dropped;
+
+  if(removed || optimized->eeprom) {
+    fprintf(console, "Saved:\t%5d bytes of SRAM, %d bytes of EEPROM by removing %d commands\n",
+            optimized->sram, optimized->eeprom, removed);
+    fprintf(console, "\t(%d hoisted, %d overwritten, %d merged, %d without effect)\n",
+            optimized->hoisted, optimized->shadowed, optimized->merged, optimized->dropped);
+  }
 }
 
 //-----------------------------------------------------------------------------
@@ -703,26 +2554,51 @@ void usage(void) {
   printf("      overlay64 <options>\n");
   printf("      overlay64 [configure] <infile|->\n");  
   printf("      overlay64 convert [<infile>|-] [<outfile>|-]\n");
+  printf("      overlay64 convert [--jobs <n>] <infile>... -o <outdir>\n");
+  printf("      overlay64 render [--pins <levels>] [--font <file>] <infile> -o <outfile>\n");
+  printf("      overlay64 render [--jobs <n>] [--font <file>] <infile> -o <outdir>\n");
   printf("      overlay64 update <firmware> [<config>]\n");
+  printf("      overlay64 --all configure <infile>\n");
+  printf("      overlay64 --all update <firmware> [<config>]\n");
   printf("      overlay64 font-convert <infile> <outfile>\n");
   printf("      overlay64 font-update <infile>\n");
+  printf("      overlay64 write <row> <col> <text>\n");
+  printf("      overlay64 input <pin> <0|1>\n");
+  printf("      overlay64 monitor [<logfile>]\n");
+  printf("      overlay64 watch <infile>\n");
   printf("      overlay64 identify\n");
   printf("      overlay64 boot\n");
   printf("      overlay64 reset\n");          
+  printf("      overlay64 benchmark [<infile>]\n");
   printf("\n");
   printf("  Options:\n");
   printf("      -v, --version : print version information\n");
   printf("      -h, --help    : print this help text\n");
+  printf("      -a, --all     : configure/update all connected devices at once\n");
+  printf("      -V, --verify  : read back and check flash or configuration after writing it,\n");
+  printf("                      checking a configuration resets the device\n");
+  printf("      -e, --emulate : talk to emulated devices instead of usb (=<n> for n)\n");
+  printf("      -j, --jobs    : number of files to convert at once (default: all cpus)\n");
+  printf("      -o, --output  : directory to convert several files into, or to render to\n");
+  printf("      -p, --pins    : input levels to render, bit n is pin n (default: every state)\n");
+  printf("      -f, --font    : font file to render with (default: the firmware's)\n");
   printf("\n");
   printf("  Commands:\n");
   printf("      configure    : read/parse configuration and flash to eeprom\n");
   printf("      convert      : convert configuration to/from binary/text format\n");
+  printf("      render       : draw the frame shown for one or all input states (as PGM)\n");
   printf("      update       : update firmware from Intel HEX file\n");
   printf("      font-convert : convert C64 charset to overlay64 font file\n");
   printf("      font-update  : install font from overlay64 font file\n");    
+  printf("      write        : show live text at row/column (\"\" removes it)\n");
+  printf("      input        : set virtual input pin (%d-%d) low or high\n",
+         NUM_PINS-NUM_VIRTUAL_PINS, NUM_PINS-1);
+  printf("      monitor      : print input line changes (and log them as CSV)\n");
+  printf("      watch        : push changes to the configuration whenever it is saved\n");
   printf("      identify     : report firmware version and build date\n");
   printf("      boot         : make device enter bootloader mode\n");
   printf("      reset        : reset device (leave bootloader/restart application)\n"); 
+  printf("      benchmark    : measure live text updates per second (or parse time of <infile>)\n");
   printf("\n");
   printf("  Files:\n");
   printf("      <infile>   : input file, format is autodetected\n");
@@ -751,7 +2627,7 @@ void complain(void) {
 //-----------------------------------------------------------------------------
 
 void failed(DeviceInfo *device) {
-  fprintf(stderr, "error: failed to open %s device \"%s\" (%04X:%04X)\n",
+  fprintf(console, "error: failed to open %s device \"%s\" (%04X:%04X)\n",
           device->role, device->path, device->vid, device->pid);
 }
 
@@ -21,33 +21,78 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 typedef enum { BINARY = 1, CONFIG } Format;
 
-#define USBASP_CONNECT     1
-#define USBASP_WRITEFLASH  6
-#define USBASP_READFLASH   4
-#define USBASP_WRITEEEPROM 8
-#define USBASP_DISCONNECT  2
+#define USBASP_CHUNK_SIZE  128    // wLength is limited to 255, keep it page aligned
+#define USBASP_QUEUE_DEPTH 4
+#define USBASP_RETRIES     3
+
+#define FLEET_MAX_DEVICES 64
+#define FLEET_WORKERS     8
+
+#define BATCH_MAX_WORKERS 64
+
+#define WATCH_SETTLE   50  // ms without further changes before rebuilding
+#define WATCH_INTERVAL 100 // ms between checks where inotify is missing
+
+typedef struct {
+  Segment *firmware;
+  int segments;
+  uint8_t *config;
+  uint16_t config_size;
+  uint8_t *compat;  // the config written for firmware without views
+  uint16_t compat_size;
+  uint16_t required;
+  FileList files;   // the config and everything it includes
+} Payload;
+
+typedef enum { UNIT_WAITING, UNIT_RUNNING, UNIT_OK, UNIT_FAILED } UnitState;
+
+typedef struct {
+  DeviceInfo device; // as found on the bus
+  UnitState state;
+  int bytes;         // progress of the current firmware transfer
+  int total;
+  char message[64];  // last line logged
+} Unit;
 
 bool convert(int argc, char** argv);
+bool convert_file(char *input, char *output);
+bool convert_batch(int argc, char** argv, char *outdir, int jobs);
+bool render(char *filename, char *output, char *levels, char *fontfile, int jobs);
 bool configure(int argc, char** argv);
 bool update(int argc, char** argv);
-bool program(int command, uint8_t* data, int size, unsigned int address);
+bool fleet(int argc, char** argv);
+bool load_configuration(char *filename, Payload *payload);
+bool load_firmware(char *filename, Payload *payload);
+bool deliver(Payload *payload);
+void free_payload(Payload *payload);
+bool program(int command, Segment *segments, int count);
+bool verify_configuration(Payload *payload);
 bool font_convert(char *input, char *output);
 bool font_update(char *filename);
 bool boot(void);
 bool reset(void);
 bool identify(void);
+bool write_text(int argc, char** argv);
+bool input(int argc, char** argv);
+bool monitor(int argc, char** argv);
+bool watch(char *filename);
+bool benchmark(void);
+bool benchmark_parse(char *filename);
 
 bool expect(DeviceInfo *device, const char* message);
+bool activate(const char* message);
 void prepare_devices(void);
 bool is_file(const char* path);
+bool is_dir(const char* path);
 bool read_file(char* filename, uint8_t **data, int *size);
 bool write_file(char* filename, uint8_t *data, int size);
+double seconds(void);
 
 void version(void);
 void usage(void);
 void failed(DeviceInfo *device);
 void complain(void);
-void footprint(volatile Config* config);
+void footprint(volatile Config* config, uint16_t written, Optimization* optimized);
 
 void fmemupdate(FILE *fp, void *buf,  uint16_t size);
 
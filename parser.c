@@ -21,10 +21,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include "strings.h"
 #include "config.h"
 #include "parser.h"
+#include "lexer.h"
+#include "protocol.h"
+#include "source.h"
 
 #define TIMEOUT 0x01
 #define SAMPLE  0x02
@@ -34,14 +38,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define SCREEN  0x07
 #define CONTROL 0x08
 
-volatile Config* config;
-uint16_t written = 0;
-const char *ws = " \t";
+__thread FILE *parser_log_stream = NULL;
 
-static int fputcc(int ch, FILE* fp) {
+// Writes a byte and counts it, so that writers can report their size
+static uint16_t fputcc(int ch, FILE* fp) {
   fputc(ch, fp);
-  written++;
-  return ch;
+  return 1;
 }
 
 //-----------------------------------------------------------------------------
@@ -106,88 +108,277 @@ static bool isSymbolName(char *name) {
 }
 
 //-----------------------------------------------------------------------------
-// Functions for parsing datatstructures from text format
+// Reading the configuration and the files it includes
 //-----------------------------------------------------------------------------
 
-bool Config_parse(volatile Config* self, FILE* in) {  
+void FileList_add(FileList* self, const char* name) {
+  
+  for(int i=0; i<self->count; i++) {
+    if(strcmp(self->names[i], name) == 0) return;
+  }
+  self->names = (char**) realloc(self->names, (self->count+1) * sizeof(char*));
+  self->names[self->count++] = strdup(name);
+}
 
-  bool result = false;
-  char* buffer = (char*) calloc(4096, sizeof(char));
-  char *line;
-  char *word;
-  char *name;
-  char *value;
-  char *equals;
-  char *comment;
-  int keyword;
-  int trailing = 0; 
-  int i = 0;
-  uint8_t timeout;
-  Screen* screen = NULL;
-  StringList* words = StringList_new();
+//-----------------------------------------------------------------------------
+
+void FileList_free(FileList* self) {
+  for(int i=0; i<self->count; i++) {
+    free(self->names[i]);
+  }
+  free(self->names);
+  memset(self, 0, sizeof(FileList));
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct {
+  StringList *words;
+  Arena *arena;
+  Source **included; // every file read so far, by content
+  int num_included;
+  int capacity;
+  bool stopped;      // a line that is neither definition nor command
+  int pos;           // last line read from the main file
+  FileList *files;   // records the files read, if given
+} Parser;
+
+static const char *delim = "\n\t ";
+
+static bool Parser_read(Parser *self, const char *filename, FILE *in, int depth);
+
+//-----------------------------------------------------------------------------
+
+static bool Parser_include(Parser *self, const char *including, const char *path, int line, int depth) {
+  const char *slash = NULL;
+  char *filename;
+  int len = 0;
+  FILE *in;
+  bool result;
   
-  fseek(in, 0, SEEK_SET);
+  // relative paths start from the directory of the including file
+  if(including != NULL && path[0] != '/' && path[0] != '\\' && strchr(path, ':') == NULL) {
+    for(const char *c = including; *c; c++) {
+      if(*c == '/' || *c == '\\') slash = c;
+    }
+    if(slash != NULL) len = slash - including + 1;
+  }
 
-  int pos = 0;
-  while(fgets(buffer, 4095, in) != NULL) {
-    line = buffer;
-    pos++;
+  filename = (char*) Arena_alloc(self->arena, len + strlen(path) + 1);
+  memcpy(filename, including, len);
+  strcpy(filename + len, path);
 
-    // skip leading whitespace
-    line += strspn(line, ws);
+  // recorded even if missing, it may yet be created
+  if(self->files != NULL) {
+    FileList_add(self->files, filename);
+  }
+
+  if((in = fopen(filename, "rb")) == NULL) {
+    fprintf(parser_log, "error: %s: line %d: %s: %s\n",
+            including ? including : "-", line, filename, strerror(errno));
+    return false;
+  }
+  result = Parser_read(self, filename, in, depth+1);
+  fclose(in);
+  return result;
+}
 
-    // skip empty lines and comments
-    if(line[0] == '\n' || line[0] == '\r' || line[0] == '#') continue;
+//-----------------------------------------------------------------------------
+
+static bool Parser_apply(Parser *self, SourceEntry *entry, const char *filename, int depth) {
+  
+  switch(entry->type) {
 
-    // remove comment at the end of the line
-    if((comment = strstr(line, "#")) != NULL) {
-      int quotes = 0;
-      for(int i=0; i<comment-line; i++) {
-        if(line[i] == '"') quotes++;        
+  case SOURCE_DEFINITION:
+    if(!StringList_add_definition(self->words, entry->text, entry->value)) {
+      if(depth) {
+        fprintf(parser_log, "error: %s: line %d: '%s': symbol already defined\n",
+                filename, entry->line, entry->text);
       }
-      if(quotes % 2 == 0) {
-        comment[0] = '\0';
+      else {
+        fprintf(parser_log, "error: line %d: '%s': symbol already defined\n",
+                entry->line, entry->text);
       }
+      return false;
     }
+    break;
 
-    // discard newlines
-    if(line[strlen(line)-1] == '\n') {
-      line[strlen(line)-1] = '\0';
-    }
+  case SOURCE_TOKEN:
+    StringList_append(self->words, entry->text, delim);
+    break;
+
+  case SOURCE_INCLUDE:
+    return Parser_include(self, filename, entry->text, entry->line, depth);
 
-    if(line[strlen(line)-1] == '\r') {
-      line[strlen(line)-1] = '\0';
+  case SOURCE_END:
+    self->stopped = true;
+    break;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool Parser_replay(Parser *self, Source *source, const char *filename, int depth) {
+  for(int i=0; i<source->size && !self->stopped; i++) {
+    if(!Parser_apply(self, &source->entries[i], filename, depth)) {
+      return false;
     }
+  }
+  return true;
+}
 
-    // check if this command is a definition
-    if((strstr(line, "=")) != NULL) {
-      name = strdup(line);
-      equals = strstr(name, "=");
-      equals[0] = '\0';
+//-----------------------------------------------------------------------------
+// Entries are applied as soon as they are lexed, and recorded for the
+// cache on the way if a source is given
+//-----------------------------------------------------------------------------
 
-      if((trailing = strcspn(name, ws)) > 0) {
-        name[trailing] = '\0';
+static bool Parser_lex(Parser *self, Lexer *lexer, Source *source, const char *filename, int depth) {
+  SourceEntry entry;
+  Token token, name, value;
+  int keyword;
+  bool first;
+  
+  while(!self->stopped && Lexer_next_line(lexer)) {
+    entry.line = lexer->line;
+    entry.value = NULL;
+    
+    // check if this command is a definition
+    if(Lexer_get_definition(lexer, &name, &value)) {
+      if(!isSymbolName(name.text) || parseKeyword(name.text, &keyword)) {
+        entry.type = SOURCE_END;
+        entry.text = NULL;
       }
+      else {
+        entry.type = SOURCE_DEFINITION;
+        entry.text = name.text;
+        entry.value = value.text;
+      }
+      if(source) Source_add(source, entry.type, entry.line, entry.text, entry.value);
+      if(!Parser_apply(self, &entry, filename, depth)) return false;
+      continue;
+    }
+
+    first = true;
+    while(!self->stopped && Lexer_next_token(lexer, &token, delim)) {
+      entry.type = SOURCE_TOKEN;
+      entry.text = token.text;
       
-      if(!isSymbolName(name) || parseKeyword(name, &keyword)) {
-        goto not_a_symbol;
+      if(first && strcmp(token.text, "include") == 0) {
+        if(!Lexer_next_token(lexer, &token, delim) || token.text[0] != '"') {
+          fprintf(parser_log, "error: %s: line %d: include without file name\n",
+                  filename ? filename : "-", lexer->line);
+          return false;
+        }
+        entry.type = SOURCE_INCLUDE;
+        entry.text = token.text+1;
       }
+      if(source) Source_add(source, entry.type, entry.line, entry.text, NULL);
+      if(!Parser_apply(self, &entry, filename, depth)) return false;
+      first = false;
+    }
+  }
+  if(!depth) self->pos = lexer->line;
+  if(source) source->lines = lexer->line;
+  return true;
+}
 
-      value = equals+1;
-      value = trim(value);
+//-----------------------------------------------------------------------------
 
-      if(StringList_has_definition(name)) {
-        fprintf(stderr, "error: line %d: '%s': symbol already defined\n", pos, name);
-        goto done;
-      }
-      StringList_add_definition(name, value);
+static bool Parser_read(Parser *self, const char *filename, FILE *in, int depth) {
+  Lexer lexer;
+  Source *source = NULL;
+  Source *cached = NULL;
+  Source **included;
+  uint64_t hash;
+  bool result = true;
+
+  if(!Lexer_open(&lexer, in)) {
+    fprintf(parser_log, "error: %s: could not read configuration\n", filename ? filename : "-");
+    return false;
+  }
+  hash = Source_hash(lexer.data, lexer.size);
+
+  // a file included more than once is only read the first time, so that
+  // shared definitions can be included wherever they are needed
+  for(int i=0; i<self->num_included; i++) {
+    if(self->included[i]->hash == hash) {
+      goto done;
     }
-    else {
-      StringList_append_quoted(words, line, "\n\t ");
+  }
+
+  // only included files are cached, the main file changes all the time
+  if(depth && (cached = Source_load(self->arena, hash)) != NULL) {
+    source = cached;
+  }
+  else {
+    source = Source_new(self->arena, hash);
+  }
+  
+  if(self->num_included == self->capacity) {
+    self->capacity = self->capacity ? self->capacity*2 : 16;
+    included = (Source**) Arena_alloc(self->arena, self->capacity * sizeof(Source*));
+    if(self->num_included) {
+      memcpy(included, self->included, self->num_included * sizeof(Source*));
+    }
+    self->included = included;
+  }
+  self->included[self->num_included++] = source;
+
+  if(cached) {
+    result = Parser_replay(self, cached, filename, depth);
+  }
+  else {
+    result = Parser_lex(self, &lexer, depth ? source : NULL, filename, depth);
+
+    // a source cut short by a nested include is incomplete
+    if(result && depth &&
+       (!self->stopped || source->entries[source->size-1].type == SOURCE_END)) {
+      Source_save(source);
     }
   }
 
- not_a_symbol:
+ done:
+  Lexer_close(&lexer);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// Functions for parsing datatstructures from text format
+//-----------------------------------------------------------------------------
+
+bool Config_parse(volatile Config* self, FILE* in, const char* filename) {  
+  return Config_parse_files(self, in, filename, NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+bool Config_parse_files(volatile Config* self, FILE* in, const char* filename, FileList* files) {  
+
+  bool result = false;
+  char *word;
+  int keyword;
+  int i = 0;
+  uint8_t timeout;
+  Screen* screen = NULL;
+  Arena* arena = Arena_new();
+  StringList* words = StringList_new(arena);
+  Parser parser;
+  int pos = 0;
+
+  memset(&parser, 0, sizeof(Parser));
+  parser.words = words;
+  parser.arena = arena;
+  parser.files = files;
+
+  if(files != NULL && filename != NULL) {
+    FileList_add(files, filename);
+  }
+
+  if(!Parser_read(&parser, filename, in, 0)) {
+    goto done;
+  }
+  pos = parser.pos;
 
   while(i<words->size) {
     word = StringList_get(words, i);
@@ -196,26 +387,26 @@ bool Config_parse(volatile Config* self, FILE* in) {
       i++;
 
       if(keyword == CONTROL) {
-        if(!Control_parse(Config_add_control(self, Control_new()), words, &i))
+        if(!Control_parse(Config_add_control(self, Control_new()), self, words, &i))
           goto done;
       }
       
       if(keyword == SCREEN) {
         screen = Screen_new();
-        if(!Screen_parse(Config_add_screen(self, screen), words, &i))
+        if(!Screen_parse(Config_add_screen(self, screen), self, words, &i))
           goto done;
       }
             
       else if(keyword == SAMPLE) {
         if(screen == NULL) {
-          fprintf(stderr, "error: line %d: sample specified before any screens\n", pos);
+          fprintf(parser_log, "error: line %d: sample specified before any screens\n", pos);
           goto done;
         }
-        if(!Sample_parse(Screen_add_sample(screen, Sample_new(screen)), words, &i))
+        if(!Sample_parse(Screen_add_sample(screen, Sample_new(screen)), self, words, &i))
           goto done;
       }
       else if(keyword == WRITE || keyword == CLEAR) {
-        fprintf(stderr, "error: line %d: command specified before any screens\n", pos);
+        fprintf(parser_log, "error: line %d: command specified before any screens\n", pos);
         goto done;     
       }
       else if(keyword == TIMEOUT) {
@@ -227,7 +418,7 @@ bool Config_parse(volatile Config* self, FILE* in) {
     }
     else {
       result = false;
-      fprintf(stderr, "error: line %d: '%s': unknown keyword\n", pos, word);
+      fprintf(parser_log, "error: line %d: '%s': unknown keyword\n", pos, word);
       goto done;
     }
   }
@@ -236,21 +427,26 @@ bool Config_parse(volatile Config* self, FILE* in) {
   result = true;
   
  done:
+  Arena_free(arena);
   return result;
 }
 
 //-----------------------------------------------------------------------------
 
-bool Control_parse(Control* self, StringList* words, int *i) {
+bool Control_parse(Control* self, volatile Config* config, StringList* words, int *i) {
   uint8_t pin;
   uint8_t mode;
   uint8_t index;
   
   if(!parseInt(StringList_get(words, *i), 0, &pin)) {
-    fprintf(stderr, "error: control: no control pin specified\n");
+    fprintf(parser_log, "error: control: no control pin specified\n");
     return false;
   }
-  self->pin = config->pins[pin];
+  if(pin >= NUM_PINS) {
+    fprintf(parser_log, "error: control: pin %d out of range\n", pin);
+    return false;
+  }
+  self->pin = Config_get_pin(config, pin);
   (*i)++;
 
   if(parseMode(StringList_get(words, *i), &mode)) {
@@ -266,7 +462,7 @@ bool Control_parse(Control* self, StringList* words, int *i) {
 
 //-----------------------------------------------------------------------------
 
-bool Screen_parse(Screen* self, StringList* words, int *i) {
+bool Screen_parse(Screen* self, volatile Config* config, StringList* words, int *i) {
   uint8_t mode;
   int keyword;
   Command* command;
@@ -280,7 +476,7 @@ bool Screen_parse(Screen* self, StringList* words, int *i) {
     if(keyword == WRITE || keyword == CLEAR) {
       (*i)++;
       command = Command_new(self);
-      Command_parse(command, keyword, words, i);     
+      Command_parse(command, config, keyword, words, i);     
       CommandList_add_command(self->commands, command);
     }
     else {
@@ -292,12 +488,16 @@ bool Screen_parse(Screen* self, StringList* words, int *i) {
 
 //-----------------------------------------------------------------------------
 
-bool Sample_parse(Sample* self, StringList* words, int *i) {
+bool Sample_parse(Sample* self, volatile Config* config, StringList* words, int *i) {
 
   uint8_t pin;  
   
   while(parseInt(StringList_get(words, *i), 0, &pin)) {
-    Sample_add_pin(self, config->pins[pin]);
+    if(pin >= NUM_PINS) {
+      fprintf(parser_log, "error: sample: pin %d out of range\n", pin);
+      goto error;
+    }
+    Sample_add_pin(self, Config_get_pin(config, pin));
     (*i)++;
   }
 
@@ -316,13 +516,13 @@ bool Sample_parse(Sample* self, StringList* words, int *i) {
       (*i)++;
 
       if(!parseInt(StringList_get(words, *i), 2, &index)) {
-        fprintf(stderr, "WHEN without condition\n");
+        fprintf(parser_log, "WHEN without condition\n");
         goto error;
       }
       (*i)++;
 
       if(index >= self->num_command_lists) {
-        fprintf(stderr, "condition out of range\n");
+        fprintf(parser_log, "condition out of range\n");
         goto error;
       }      
       commands = self->command_lists[index];
@@ -330,7 +530,7 @@ bool Sample_parse(Sample* self, StringList* words, int *i) {
     else if(keyword == WRITE || keyword == CLEAR) {
       (*i)++;
       command = Command_new(self->screen);
-      Command_parse(command, keyword, words, i);
+      Command_parse(command, config, keyword, words, i);
       CommandList_add_command(commands, command);
     }
     else {
@@ -346,12 +546,10 @@ bool Sample_parse(Sample* self, StringList* words, int *i) {
 
 //-----------------------------------------------------------------------------
 
-bool Command_parse(Command *self, int keyword, StringList* words, int *i) {
+bool Command_parse(Command *self, volatile Config* config, int keyword, StringList* words, int *i) {
 
   uint8_t value;
-  char *string = (char*) calloc(4096, sizeof(char));
-  char *ptr = string;
-  
+  char *string;
   uint8_t index;
   
   self->action = (keyword == WRITE) ?
@@ -386,7 +584,6 @@ bool Command_parse(Command *self, int keyword, StringList* words, int *i) {
     self->len = value;
     (*i)++;
   }
-  free(ptr);
   return true;
 }
 
@@ -399,21 +596,21 @@ void Config_print(volatile Config* self, FILE* out) {
   fprintf(out, "timeout %d\n", self->timeout);
 
   for(int i=0; i<self->num_controls; i++) {
-    Control_print(self->controls[i], out);
+    Control_print(self->controls[i], self, out);
   }
 
   for(int i=0; i<self->num_screens; i++) {
-    Screen_print(self->screens[i], out);
+    Screen_print(self->screens[i], self, out);
   }
 }
 
 //-----------------------------------------------------------------------------
 
 uint8_t Config_index_of_pin(volatile Config* self, Pin* pin) {
-  for(int i=0; i<NUM_PINS; i++) {
-    if(self->pins[i] == pin) {
-      return i;
-    }
+  Pin* first = Config_get_pin(self, 0);
+  
+  if(pin >= first && pin < first+NUM_PINS) {
+    return pin - first;
   }
   return 0xff;
 }
@@ -432,6 +629,14 @@ uint8_t Config_index_of_screen(volatile Config* self, Screen* screen) {
 //-----------------------------------------------------------------------------
 
 uint8_t Config_index_of_string(volatile Config* self, char* string) {
+  uint8_t index;
+
+  // Commands point into the strings, so look them up by content first
+  if(string != NULL &&
+     Config_has_string(self, string, &index) && self->strings[index] == string) {
+    return index;
+  }
+  
   for(int i=0; i<self->num_strings; i++) {
     if(self->strings[i] == string) {
       return i;
@@ -442,9 +647,9 @@ uint8_t Config_index_of_string(volatile Config* self, char* string) {
 
 //-----------------------------------------------------------------------------
 
-void Control_print(Control* self, FILE* out) {
+void Control_print(Control* self, volatile Config* config, FILE* out) {
   fprintf(out, "control ");
-  Pin_print(self->pin, out);
+  Pin_print(self->pin, config, out);
 
   if(self->mode == MODE_MANUAL) {
     fprintf(out, "manual ");
@@ -463,7 +668,7 @@ void Control_print(Control* self, FILE* out) {
 
 //-----------------------------------------------------------------------------
 
-void Screen_print(Screen* self, FILE* out) {
+void Screen_print(Screen* self, volatile Config* config, FILE* out) {
   fprintf(out, "screen ");
 
   if(self->mode == MODE_MANUAL) {
@@ -483,7 +688,7 @@ void Screen_print(Screen* self, FILE* out) {
   CommandList_print(self->commands, out);
   
   for(int i=0; i<self->num_samples; i++) {
-    Sample_print(self->samples[i], out);
+    Sample_print(self->samples[i], config, out);
   }
 }
 
@@ -499,12 +704,12 @@ static void binary(uint8_t value, char **result) {
 
 //-----------------------------------------------------------------------------
 
-void Sample_print(Sample* self, FILE* out) {
+void Sample_print(Sample* self, volatile Config* config, FILE* out) {
 
   fprintf(out, "sample ");
 
   for(int i=0; i<self->num_pins; i++) {
-    Pin_print(self->pins[i], out);
+    Pin_print(self->pins[i], config, out);
   }
   
   fprintf(out, "\n");
@@ -568,7 +773,7 @@ void Command_print(Command *self, FILE* out) {
 
 //-----------------------------------------------------------------------------
    
-void Pin_print(Pin* self, FILE* out) {
+void Pin_print(Pin* self, volatile Config* config, FILE* out) {
   fprintf(out, "%d ", Config_index_of_pin(config, self));
 }
 
@@ -576,241 +781,184 @@ void Pin_print(Pin* self, FILE* out) {
 // Functions to write datastructures in binary format
 //-----------------------------------------------------------------------------
 
-static void Config_write_magic(FILE* out) {
-  fputcc(CONFIG_MAGIC[0], out);
-  fputcc(CONFIG_MAGIC[1], out);
+static uint16_t Config_write_magic(FILE* out) {
+  uint16_t written = 0;
+  written += fputcc(CONFIG_MAGIC[0], out);
+  written += fputcc(CONFIG_MAGIC[1], out);
+  return written;
 }
 
-static void Config_write_timeout(volatile Config* self, FILE* out) {
-  fputcc(self->timeout, out);
+static uint16_t Config_write_timeout(volatile Config* self, FILE* out) {
+  return fputcc(self->timeout, out);
 }
 
-static void Config_write_strings(volatile Config* self, FILE* out) {
-  fputcc(self->num_strings, out);
-  for(uint8_t i=0; i<self->num_strings; i++) {
-    fputcc(strlen(self->strings[i]), out);
-    fputs(self->strings[i], out);
-    written += strlen(self->strings[i]);
-  }
-}
+// Strings are written longest first, so that any string that contains
+// another is written before it, otherwise in order of appearance. The
+// config keeps its own order, a string's place in the binary is
+// worked out from it.
 
-static void Config_write_controls(volatile Config* self, FILE* out) {
- fputcc(self->num_controls, out);
-  for(uint8_t i=0; i<self->num_controls; i++) {
-    Control_write(self->controls[i], out);
-  }
-}
+static uint8_t Config_position_of_string(volatile Config* self, uint8_t index) {
+  uint8_t position = 0;
+  size_t len;
 
-static void Config_write_screens(volatile Config* self, FILE* out) {
- fputcc(self->num_screens, out);
-  for(uint8_t i=0; i<self->num_screens; i++) {
-    Screen_write(self->screens[i], out);
+  if(index >= self->num_strings) {
+    return index;
   }
-}
-
-void Config_write(volatile Config* self, FILE* out) {
-  Config_write_magic(out);
-  Config_write_timeout(self, out);
-  Config_write_strings(self, out);
-  Config_write_controls(self, out);
-  Config_write_screens(self, out);
-}
-
-//-----------------------------------------------------------------------------
-
-void Control_write(Control* self, FILE* out) {
-  Pin_write(self->pin, out);
-  fputcc(self->mode, out);
-
-  fputcc(self->num_screens, out);  
-  for(uint8_t i=0; i<self->num_screens; i++) {
-    fputcc(self->screens[i], out);
-  }         
-}
-
-//-----------------------------------------------------------------------------
-
-void Screen_write(Screen* self, FILE* out) {
-  fputcc(self->mode, out);
+  len = strlen(self->strings[index]);
 
-  CommandList_write(self->commands, out);
-
-  fputcc(self->num_samples, out);
-  for(uint8_t i=0; i<self->num_samples; i++) {
-    Sample_write(self->samples[i], out);
+  for(uint8_t i=0; i<self->num_strings; i++) {
+    if(strlen(self->strings[i]) > len ||
+       (strlen(self->strings[i]) == len && i < index)) {
+      position++;
+    }
   }
+  return position;
 }
 
-//-----------------------------------------------------------------------------
-
-void Sample_write(Sample* self, FILE* out) {
+static uint16_t Config_write_strings(volatile Config* self, FILE* out, bool views) {
+  uint16_t written = fputcc(self->num_strings, out);
+  char *strings[256];
+  char *found;
+  size_t len;
+  uint8_t k;
 
-  fputcc(self->num_pins, out);
-  for(uint8_t i=0; i<self->num_pins; i++) {
-    Pin_write(self->pins[i], out);
+  for(uint8_t i=0; i<self->num_strings; i++) {
+    strings[Config_position_of_string(self, i)] = self->strings[i];
   }
-
-  CommandList_write(self->command_list, out);
   
-  for(uint8_t i=0; i<self->num_command_lists; i++) {
-    CommandList_write(self->command_lists[i], out);
+  for(uint8_t i=0; i<self->num_strings; i++) {
+    len = strlen(strings[i]);
+
+    // A string contained in one written before is written as a view
+    // into it, which takes four bytes
+    for(k=0; k<i && len > 3 && views; k++) {
+      if((found = strstr(strings[k], strings[i])) != NULL &&
+         found - strings[k] <= 0xff) {
+        break;
+      }
+    }
+
+    if(k < i && len > 3 && views) {
+      written += fputcc(0, out);
+      written += fputcc(k, out);
+      written += fputcc(found - strings[k], out);
+      written += fputcc(len, out);
+    }
+    else {
+      written += fputcc(len, out);
+      fputs(strings[i], out);
+      written += len;
+    }
   }
+  return written;
 }
 
-//-----------------------------------------------------------------------------
-  
-void Pin_write(Pin* self, FILE* out) {
-  fputcc(Config_index_of_pin(config, self), out);
+static uint16_t Config_write_controls(volatile Config* self, FILE* out) {
+  uint16_t written = fputcc(self->num_controls, out);
+  for(uint8_t i=0; i<self->num_controls; i++) {
+    written += Control_write(self->controls[i], self, out);
+  }
+  return written;
 }
 
-//-----------------------------------------------------------------------------
-
-void CommandList_write(CommandList *self, FILE* out) {
-  fputcc(self->num_commands, out);
-  for(uint8_t i=0; i<self->num_commands; i++) {
-    Command_write(self->commands[i], out);
+static uint16_t Config_write_screens(volatile Config* self, FILE* out) {
+  uint16_t written = fputcc(self->num_screens, out);
+  for(uint8_t i=0; i<self->num_screens; i++) {
+    written += Screen_write(self->screens[i], self, out);
   }
+  return written;
 }
 
-//-----------------------------------------------------------------------------
-
-void Command_write(Command *self, FILE* out) {
-  fputcc(self->action, out);
-  fputcc(self->row, out);  
-  fputcc(self->col, out);
-  fputcc(self->len, out);
-  fputcc(Config_index_of_string(config, self->string), out);
+uint16_t Config_write(volatile Config* self, FILE* out) {
+  return Config_write_for(self, out, OVERLAY64_FEATURES);
 }
 
-//-----------------------------------------------------------------------------
-// functions for calculating the required memory footprint
-//-----------------------------------------------------------------------------
-
-uint16_t Config_get_footprint(volatile Config* self) {
-  uint16_t fp = 0;
+// Leaves out whatever firmware without the given features can't read
 
-  fp += 2;                // the pointer to the config itself
-  fp += 3*2;              // the pointers to the ports
-
-  fp += NUM_PINS*2;               // the pointers to the pins
-  fp += NUM_PINS*sizeof(Pin);     // the actual pins
-
-  fp += 1; // enabled
-  fp += 1; // timeout 
-  
-  fp += 1;                     // num_strings
-  fp += self->num_strings * 2; // the pointers to the strings;
+uint16_t Config_write_for(volatile Config* self, FILE* out, uint8_t features) {
+  uint16_t written = 0;
+  written += Config_write_magic(out);
+  written += Config_write_timeout(self, out);
+  written += Config_write_strings(self, out, features & OVERLAY64_FEATURE_VIEWS);
+  written += Config_write_controls(self, out);
+  written += Config_write_screens(self, out);
+  return written;
+}
 
-  // the strings themselves
-  for(uint8_t i=0; i<self->num_strings; i++) {
-    fp += strlen(self->strings[i])+1;
-  }
+//-----------------------------------------------------------------------------
 
-  fp += 1; // num_controls
-  fp += self->num_controls*2; // control pointers
-  for(uint8_t i=0; i<self->num_controls; i++) {
-    fp += Control_get_footprint(self->controls[i]);
-  }
+uint16_t Control_write(Control* self, volatile Config* config, FILE* out) {
+  uint16_t written = 0;
+  written += Pin_write(self->pin, config, out);
+  written += fputcc(self->mode, out);
 
-  fp += 1; // num_screens;
-  fp += self->num_screens*2; // screen pointers
+  written += fputcc(self->num_screens, out);  
   for(uint8_t i=0; i<self->num_screens; i++) {
-    fp += Screen_get_footprint(self->screens[i]);
+    written += fputcc(self->screens[i], out);
   }
-  
-  fp += SCREEN_ROWS * 2;  // the pointers to the rows
-
-  fp += 64*8;  // the font data
-  fp += 1+1+2; // global scanline
-
-  return fp;
+  return written;
 }
 
 //-----------------------------------------------------------------------------
 
-int Control_get_footprint(Control* self) {
-  int fp = 2; // Pin pointer
-  fp += 1; // mode;
-  fp += 1; // asserted;
-  fp += 1; // num_screens;
-  fp += self->num_screens; // screen indices;
-  return fp;
-}
-
-//-----------------------------------------------------------------------------
+uint16_t Screen_write(Screen* self, volatile Config* config, FILE* out) {
+  uint16_t written = 0;
+  written += fputcc(self->mode, out);
 
-int Screen_get_footprint(Screen* self) {
-  int fp = 1; // mode
-  fp += 1; // enabled
-  fp += 1; // timeout
+  written += CommandList_write(self->commands, config, out);
 
-  fp += 1; // num_samples;
-  fp += self->num_samples*2; // sample pointers
+  written += fputcc(self->num_samples, out);
   for(uint8_t i=0; i<self->num_samples; i++) {
-    fp += Sample_get_footprint(self->samples[i]);
-  }
-
-  fp += 1; // num_controls
-  fp += self->num_controls*2; // control pointers
-
-  fp += CommandList_get_footprint(self->commands);
-  
-  fp += SCREEN_ROWS * 2;  // the pointers to the rows
-
-  // the allocated rows themselves
-  for(uint8_t i=0; i<SCREEN_ROWS; i++) {
-    fp += (self->rows[i] != NULL) ? SCREEN_COLUMNS : 0;
+    written += Sample_write(self->samples[i], config, out);
   }
-  return fp;
+  return written;
 }
 
 //-----------------------------------------------------------------------------
 
-uint16_t Sample_get_footprint(Sample* self) {
-  uint16_t fp = 0;
-  fp += 1; // num_pins
-  fp += self->num_pins * 2;
+uint16_t Sample_write(Sample* self, volatile Config* config, FILE* out) {
+  uint16_t written = 0;
 
-  fp += 1; // num_commands;
-  fp += self->num_command_lists * 2; // pointers to the CommandLists
+  written += fputcc(self->num_pins, out);
+  for(uint8_t i=0; i<self->num_pins; i++) {
+    written += Pin_write(self->pins[i], config, out);
+  }
 
-  // the CommandLists themselves
+  written += CommandList_write(self->command_list, config, out);
+  
   for(uint8_t i=0; i<self->num_command_lists; i++) {
-    fp += CommandList_get_sparse_footprint(self->command_lists[i]);
+    written += CommandList_write(self->command_lists[i], config, out);
   }
-  
-  return fp;
+  return written;
 }
 
 //-----------------------------------------------------------------------------
+  
+uint16_t Pin_write(Pin* self, volatile Config* config, FILE* out) {
+  return fputcc(Config_index_of_pin(config, self), out);
+}
 
-uint16_t CommandList_get_footprint(CommandList* self) {
-  uint16_t fp = 0;
-
-  fp += CommandList_get_sparse_footprint(self);
+//-----------------------------------------------------------------------------
 
-  // the commands themselves
+uint16_t CommandList_write(CommandList *self, volatile Config* config, FILE* out) {
+  uint16_t written = fputcc(self->num_commands, out);
   for(uint8_t i=0; i<self->num_commands; i++) {
-    fp += Command_get_footprint(self->commands[i]);
+    written += Command_write(self->commands[i], config, out);
   }
-  return fp;
+  return written;
 }
 
-//-----------------------------------------------------------------------------
- 
-uint16_t CommandList_get_sparse_footprint(CommandList* self) {
-  uint16_t fp = 0;
-  fp += 1;                       // num_commands;
-  fp += self->num_commands * 2;  // the pointers to the commands
-  return fp;
-}
- 
 //-----------------------------------------------------------------------------
 
-uint16_t Command_get_footprint(Command* self) {
-  uint16_t fp = 0;
-  fp += 1+1+1+2+2; // action, col, row, len, string pointer
-  return fp;
+uint16_t Command_write(Command *self, volatile Config* config, FILE* out) {
+  uint16_t written = 0;
+  written += fputcc(self->action, out);
+  written += fputcc(self->row, out);  
+  written += fputcc(self->col, out);
+  written += fputcc(self->len, out);
+  written += fputcc(Config_position_of_string(config,
+                                              Config_index_of_string(config, self->string)), out);
+  return written;
 }
 
 //-----------------------------------------------------------------------------
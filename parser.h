@@ -25,42 +25,50 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "strings.h"
 #include "config.h"
 
-bool Config_parse(volatile Config* self, FILE* in);
+// Diagnostics go to stderr, unless redirected for the calling thread
+extern __thread FILE *parser_log_stream;
+#define parser_log (parser_log_stream != NULL ? parser_log_stream : stderr)
+
+// Names of the files a configuration was read from
+typedef struct {
+  char **names;
+  int count;
+} FileList;
+
+void FileList_add(FileList* self, const char* name);
+void FileList_free(FileList* self);
+
+bool Config_parse(volatile Config* self, FILE* in, const char* filename);
+bool Config_parse_files(volatile Config* self, FILE* in, const char* filename, FileList* files);
 void Config_print(volatile Config* self, FILE* out);
-void Config_write(volatile Config* self, FILE* out);
-uint16_t Config_get_footprint(volatile Config* self);
+uint16_t Config_write(volatile Config* self, FILE* out);
+uint16_t Config_write_for(volatile Config* self, FILE* out, uint8_t features);
 
 uint8_t Config_index_of_pin(volatile Config* self, Pin* pin);
 uint8_t Config_index_of_string(volatile Config* self, char* string);
 uint8_t Config_index_of_command(volatile Config* self, Command* command);
 uint8_t Config_index_of_screen(volatile Config* self, Screen* screen);
   
-bool Control_parse(Control* self, StringList* words, int *i);
-void Control_print(Control* self, FILE* out);
-void Control_write(Control* self, FILE* out);
-int Control_get_footprint(Control* self);
+bool Control_parse(Control* self, volatile Config* config, StringList* words, int *i);
+void Control_print(Control* self, volatile Config* config, FILE* out);
+uint16_t Control_write(Control* self, volatile Config* config, FILE* out);
 
-bool Screen_parse(Screen* self, StringList* words, int *i);
-void Screen_print(Screen* self, FILE* out);
-void Screen_write(Screen* self, FILE* out);
-int Screen_get_footprint(Screen* self);
+bool Screen_parse(Screen* self, volatile Config* config, StringList* words, int *i);
+void Screen_print(Screen* self, volatile Config* config, FILE* out);
+uint16_t Screen_write(Screen* self, volatile Config* config, FILE* out);
 
-bool Sample_parse(Sample* self, StringList* words, int *i);
-void Sample_print(Sample* self, FILE* out);
-void Sample_write(Sample* self, FILE* out);
-uint16_t Sample_get_footprint(Sample* self);
+bool Sample_parse(Sample* self, volatile Config* config, StringList* words, int *i);
+void Sample_print(Sample* self, volatile Config* config, FILE* out);
+uint16_t Sample_write(Sample* self, volatile Config* config, FILE* out);
 
-void Pin_print(Pin* self, FILE* out);
-void Pin_write(Pin* self, FILE* out);
+void Pin_print(Pin* self, volatile Config* config, FILE* out);
+uint16_t Pin_write(Pin* self, volatile Config* config, FILE* out);
 
 void CommandList_print(CommandList *self, FILE* out);
-void CommandList_write(CommandList *self, FILE* out);
-uint16_t CommandList_get_sparse_footprint(CommandList* self);
-uint16_t CommandList_get_footprint(CommandList* self);
+uint16_t CommandList_write(CommandList *self, volatile Config* config, FILE* out);
 
-bool Command_parse(Command *self, int keyword, StringList* words, int *i);
+bool Command_parse(Command *self, volatile Config* config, int keyword, StringList* words, int *i);
 void Command_print(Command *self, FILE* out);
-void Command_write(Command *self, FILE* out);
-uint16_t Command_get_footprint(Command* self);
+uint16_t Command_write(Command *self, volatile Config* config, FILE* out);
 
 #endif // PARSER_H
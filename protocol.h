@@ -19,9 +19,39 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stdint.h>
+
 #define OVERLAY64_BOOT     0x01
 #define OVERLAY64_RESET    0x02
 #define OVERLAY64_IDENTIFY 0x03
 #define OVERLAY64_FLASH    0x04
+#define OVERLAY64_STATUS   0x05
+#define OVERLAY64_WRITE    0x06
+#define OVERLAY64_INPUT    0x07
+#define OVERLAY64_PATCH    0x08
+
+#define OVERLAY64_STATUS_READY 0x00
+#define OVERLAY64_STATUS_BUSY  0x01
+#define OVERLAY64_STATUS_RESET 0x02
+
+// Asking for two status bytes returns the supported features in the
+// second, older firmware only ever sends the first
+#define OVERLAY64_FEATURE_PATCH 0x01
+#define OVERLAY64_FEATURE_VIEWS 0x02 // strings stored as views into others
+#define OVERLAY64_FEATURES (OVERLAY64_FEATURE_PATCH | OVERLAY64_FEATURE_VIEWS)
+
+#define OVERLAY64_EVENT_ENDPOINT 0x81
+
+#define EEPROM_CONFIG_SIZE 0x0ffe // the last word holds the bootloader flag
+#define EEPROM_WRITE_TIME  4      // ms per byte written, 3.3ms rounded up
+
+// Pin change as reported on the interrupt-in endpoint
+typedef struct {
+  uint16_t frame;    // frame counter at the time of the change
+  uint16_t scanline; // scanline within that frame
+  uint8_t pin;       // index into the config's pins
+  uint8_t level;     // new state of the pin
+  uint8_t dropped;   // events lost right before this one
+} __attribute__((packed)) Event;
 
 #endif // PROTOTCOL_H
@@ -0,0 +1,146 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include "config.h"
+#include "parser.h"
+#include "render.h"
+#include "firmware/config.h"
+
+//-----------------------------------------------------------------------------
+
+// Does what the BACK PORCH interrupt does for each visible scanline,
+// shifting out each character's font byte msb first. Characters the
+// font has no glyph for are drawn blank.
+
+static void Frame_draw(Frame* self, volatile Config* config, const uint8_t* font) {
+  uint8_t* row;
+  uint8_t glyph;
+  uint8_t byte;
+
+  if(!config->enabled) {
+    return;
+  }
+
+  for(int line=0; line<FRAME_HEIGHT; line++) {
+    if((row = config->rows[line / CHAR_HEIGHT]) == NULL) {
+      continue;
+    }
+
+    for(int column=0; column<SCREEN_COLUMNS; column++) {
+      glyph = (row[column] < FRAME_GLYPHS) ? row[column] : 0;
+      byte = font[glyph*CHAR_HEIGHT + line % CHAR_HEIGHT];
+
+      for(int bit=0; bit<CHAR_WIDTH; bit++) {
+        self->pixels[line][column*CHAR_WIDTH+bit] = (byte & (0x80>>bit)) ? 0xff : 0x00;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+// Reads the binary image on fake ports of its own, so that frames can
+// be rendered in parallel. The config starts out with all lines idle,
+// so that the frame is the one shown right after they changed to the
+// given levels (bit n is pin n).
+
+bool Frame_render(Frame* self, uint8_t* image, uint16_t size,
+                  uint32_t levels, const uint8_t* font) {
+  bool result = false;
+  uint8_t ports[5];
+  volatile Config* config;
+  Pin *pin;
+  FILE *in = NULL;
+
+  memset(self->pixels, 0, sizeof(self->pixels));
+  memset(ports, 0xff, sizeof(ports));
+
+  config = Config_new_with_ports(&ports[0], &ports[1], &ports[2], &ports[3], &ports[4]);
+
+  if((in = fmemopen(image, size, "rb")) == NULL) {
+    goto done;
+  }
+  if(!Config_read(config, in)) {
+    goto done;
+  }
+
+  Config_setup(config);
+
+  for(uint8_t i=0; i<NUM_PINS; i++) {
+    pin = Config_get_pin(config, i);
+
+    if(levels & (1UL<<i)) {
+      *(pin->port) |= (1<<pin->pos);
+    }
+    else {
+      *(pin->port) &= ~(1<<pin->pos);
+    }
+  }
+
+  Config_apply(config, NULL);
+  Frame_draw(self, config, font);
+  result = true;
+
+ done:
+  if(in != NULL) fclose(in);
+  Config_free(config);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool Frame_write(Frame* self, FILE* out) {
+  fprintf(out, "P5\n%d %d\n255\n", FRAME_WIDTH, FRAME_HEIGHT);
+  return fwrite(self->pixels, sizeof(self->pixels), 1, out) == 1;
+}
+
+//-----------------------------------------------------------------------------
+
+// The pins any control or sample reads, in ascending order
+
+uint8_t Config_get_input_pins(volatile Config* self, uint8_t* pins) {
+  bool used[256];
+  uint8_t count = 0;
+  Screen* screen;
+  Sample* sample;
+
+  memset(used, 0, sizeof(used));
+
+  for(uint8_t i=0; i<self->num_controls; i++) {
+    used[Config_index_of_pin(self, self->controls[i]->pin)] = true;
+  }
+
+  for(uint8_t i=0; i<self->num_screens; i++) {
+    screen = self->screens[i];
+
+    for(uint8_t k=0; k<screen->num_samples; k++) {
+      sample = screen->samples[k];
+
+      for(uint8_t l=0; l<sample->num_pins; l++) {
+        used[Config_index_of_pin(self, sample->pins[l])] = true;
+      }
+    }
+  }
+
+  for(uint8_t i=0; i<NUM_PINS; i++) {
+    if(used[i]) pins[count++] = i;
+  }
+  return count;
+}
@@ -0,0 +1,48 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "config.h"
+
+#define FRAME_WIDTH  (SCREEN_COLUMNS*CHAR_WIDTH)
+#define FRAME_HEIGHT (SCREEN_ROWS*CHAR_HEIGHT)
+
+#define FRAME_GLYPHS 96 // characters in the font, from 0x20 on
+
+#define FRAME_IDLE 0xffffffff // all input lines pulled up
+
+#define RENDER_MAX_PINS 12 // pins to combine when rendering every state
+
+// One frame as the firmware bitbangs it, one byte per pixel
+typedef struct {
+  uint8_t pixels[FRAME_HEIGHT][FRAME_WIDTH];
+} Frame;
+
+bool Frame_render(Frame* self, uint8_t* image, uint16_t size,
+                  uint32_t levels, const uint8_t* font);
+bool Frame_write(Frame* self, FILE* out);
+
+uint8_t Config_get_input_pins(volatile Config* self, uint8_t* pins);
+
+#endif // RENDER_H
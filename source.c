@@ -0,0 +1,272 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "source.h"
+
+#if defined(WIN32) && !defined(__CYGWIN__)
+#define mkdir(path, mode) mkdir(path)
+#endif
+
+//-----------------------------------------------------------------------------
+
+uint64_t Source_hash(const char *data, size_t size) {
+  uint64_t hash = 14695981039346656037ull ^ size;
+  uint64_t word;
+  size_t i = 0;
+
+  // FNV-1a, but taking a word at a time and folding the high bits back
+  // in, since every file is hashed before anything else happens to it
+  for(; i+sizeof(word) <= size; i += sizeof(word)) {
+    memcpy(&word, data+i, sizeof(word));
+    hash ^= word;
+    hash *= 1099511628211ull;
+    hash ^= hash >> 32;
+  }
+
+  for(; i<size; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+//-----------------------------------------------------------------------------
+
+Source* Source_new(Arena *arena, uint64_t hash) {
+  Source *source = (Source*) Arena_alloc(arena, sizeof(Source));
+  memset(source, 0, sizeof(Source));
+  source->hash = hash;
+  source->arena = arena;
+  return source;
+}
+
+//-----------------------------------------------------------------------------
+
+static SourceEntry* Source_append(Source *self, char type, int line) {
+  SourceEntry *entries;
+
+  // Grow geometrically, the old array simply stays in the arena
+  if(self->size == self->capacity) {
+    self->capacity = self->capacity ? self->capacity*2 : 64;
+    entries = (SourceEntry*) Arena_alloc(self->arena, self->capacity * sizeof(SourceEntry));
+    if(self->size) {
+      memcpy(entries, self->entries, self->size * sizeof(SourceEntry));
+    }
+    self->entries = entries;
+  }
+  SourceEntry *entry = &self->entries[self->size++];
+  entry->type = type;
+  entry->line = line;
+  entry->text = entry->value = NULL;
+  return entry;
+}
+
+//-----------------------------------------------------------------------------
+
+void Source_add(Source *self, char type, int line, const char *text, const char *value) {
+  SourceEntry *entry = Source_append(self, type, line);
+  
+  if(text != NULL) entry->text = Arena_strdup(self->arena, text);
+  if(value != NULL) entry->value = Arena_strdup(self->arena, value);
+}
+
+//-----------------------------------------------------------------------------
+// Pre-tokenized sources are cached on disk, named after the hash of the
+// file contents, so that files shared between configurations are only
+// lexed once. Setting OVERLAY64_CACHE to an empty string disables this.
+//-----------------------------------------------------------------------------
+
+static bool Source_cache_path(uint64_t hash, char *path, size_t size, bool create) {
+  char *dir;
+  char *slash;
+  
+  if((dir = getenv("OVERLAY64_CACHE")) != NULL) {
+    if(dir[0] == '\0') return false;
+    snprintf(path, size, "%s", dir);
+  }
+  else if((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0') {
+    snprintf(path, size, "%s/overlay64", dir);
+  }
+  else if((dir = getenv("HOME")) != NULL && dir[0] != '\0') {
+    snprintf(path, size, "%s/.cache/overlay64", dir);
+  }
+  else if((dir = getenv("LOCALAPPDATA")) != NULL && dir[0] != '\0') {
+    snprintf(path, size, "%s/overlay64", dir);
+  }
+  else {
+    return false;
+  }
+
+  if(create) {
+    for(slash = strchr(path+1, '/'); slash != NULL; slash = strchr(slash+1, '/')) {
+      *slash = '\0';
+      mkdir(path, 0755);
+      *slash = '/';
+    }
+    if(mkdir(path, 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+  }
+
+  size_t len = strlen(path);
+  snprintf(path+len, size-len, "/%016llx.src", (unsigned long long) hash);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+static uint32_t Source_read_number(unsigned char *data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+//-----------------------------------------------------------------------------
+
+static void Source_write_number(uint32_t value, FILE *out) {
+  for(int i=0; i<4; i++) {
+    fputc((value >> (i*8)) & 0xff, out);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+Source* Source_load(Arena *arena, uint64_t hash) {
+  char path[4096];
+  FILE *in = NULL;
+  long size;
+  char *data;
+  char *end;
+  char *nul;
+  Source *source = NULL;
+  SourceEntry *entry;
+  uint32_t count;
+  size_t magic = strlen(SOURCE_CACHE_MAGIC);
+
+  if(!Source_cache_path(hash, path, sizeof(path), false)) {
+    goto done;
+  }
+  
+  if((in = fopen(path, "rb")) == NULL) {
+    goto done;
+  }
+
+  if(fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) < (long) magic + 8) {
+    goto done;
+  }
+  fseek(in, 0, SEEK_SET);
+
+  // the entries point straight into the cached data
+  data = (char*) Arena_alloc(arena, size);
+  end = data + size;
+
+  if(fread(data, 1, size, in) != (size_t) size ||
+     memcmp(data, SOURCE_CACHE_MAGIC, magic) != 0) {
+    goto done;
+  }
+
+  source = Source_new(arena, hash);
+  source->lines = Source_read_number((unsigned char*) data + magic);
+  count = Source_read_number((unsigned char*) data + magic + 4);
+  data += magic + 8;
+  
+  while(data < end) {
+    if(end - data < 5) goto error;
+
+    entry = Source_append(source, data[0], Source_read_number((unsigned char*) data+1));
+    data += 5;
+
+    if(entry->type == SOURCE_END) continue;
+    
+    if(entry->type != SOURCE_DEFINITION &&
+       entry->type != SOURCE_TOKEN &&
+       entry->type != SOURCE_INCLUDE) goto error;
+
+    if((nul = memchr(data, '\0', end - data)) == NULL) goto error;
+    entry->text = data;
+    data = nul+1;
+    
+    if(entry->type != SOURCE_DEFINITION) continue;
+    
+    if((nul = memchr(data, '\0', end - data)) == NULL) goto error;
+    entry->value = data;
+    data = nul+1;
+  }
+
+  // a file cut short at an entry boundary still parses, but is incomplete
+  if(source->size == count) {
+    goto done;
+  }
+
+ error:
+  source = NULL;
+  
+ done:
+  if(in != NULL) fclose(in);
+  return source;
+}
+
+//-----------------------------------------------------------------------------
+
+bool Source_save(Source *self) {
+  char path[4096];
+  char tmp[4096+64];
+  FILE *out;
+  SourceEntry *entry;
+  bool result = false;
+  
+  if(!Source_cache_path(self->hash, path, sizeof(path), true)) {
+    return false;
+  }
+
+  // written under a temporary name first, so that nobody reads a partial file
+  snprintf(tmp, sizeof(tmp), "%s.%ld.%p", path, (long) getpid(), (void*) self);
+  
+  if((out = fopen(tmp, "wb")) == NULL) {
+    return false;
+  }
+
+  fputs(SOURCE_CACHE_MAGIC, out);
+  Source_write_number(self->lines, out);
+  Source_write_number(self->size, out);
+
+  for(int i=0; i<self->size; i++) {
+    entry = &self->entries[i];
+    fputc(entry->type, out);
+    Source_write_number(entry->line, out);
+    
+    if(entry->type == SOURCE_END) continue;
+    fwrite(entry->text, 1, strlen(entry->text)+1, out);
+
+    if(entry->type != SOURCE_DEFINITION) continue;
+    fwrite(entry->value, 1, strlen(entry->value)+1, out);
+  }
+
+  result = !ferror(out);
+
+  if(fclose(out) != 0 || !result || rename(tmp, path) != 0) {
+    remove(tmp);
+    result = false;
+  }
+  return result;
+}
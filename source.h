@@ -0,0 +1,60 @@
+/*
+overlay64 -- video overlay module
+Copyright (C) 2016 Henning Bekel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "strings.h"
+
+#define SOURCE_DEFINITION 'D'
+#define SOURCE_TOKEN      'T'
+#define SOURCE_INCLUDE    'I'
+#define SOURCE_END        'E' // a line that ended the input early
+
+#define SOURCE_CACHE_MAGIC "OV64SRC1"
+
+typedef struct {
+  char type;
+  int line;
+  char *text;    // token, definition name or include file name
+  char *value;   // definition value
+} SourceEntry;
+
+// A configuration file in pre-tokenized form: definitions, tokens and
+// includes in the order they appear, before definitions are expanded
+typedef struct {
+  uint64_t hash; // of the file contents
+  int lines;
+  int size;
+  int capacity;
+  SourceEntry *entries;
+  Arena *arena;
+} Source;
+
+uint64_t Source_hash(const char *data, size_t size);
+
+Source* Source_new(Arena *arena, uint64_t hash);
+void Source_add(Source *self, char type, int line, const char *text, const char *value);
+Source* Source_load(Arena *arena, uint64_t hash);
+bool Source_save(Source *self);
+
+#endif // SOURCE_H
@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include "strings.h"
 #include "target.h"
@@ -47,77 +48,168 @@ char *strtok_r(char *str, const char *delim, char **save)
 }
 #endif
 
-Definition** StringList_definitions = NULL;
-int StringList_num_definitions = 0;
+// Definitions are looked up for every word of a config, so besides the
+// list (which keeps them in order) they are indexed by an open
+// addressing hash table with linear probing. The table is kept at most
+// half full, so probe sequences stay short. Both belong to the list of
+// words they are expanded into and live in its arena.
 
-void StringList_init() {
-  if(StringList_definitions == NULL) {
-    StringList_definitions = (Definition**) calloc(1, sizeof(Definition*));
+static Definition *Definition_new(Arena *arena, const char* name, const char* value) {
+  Definition* self = (Definition*) Arena_alloc(arena, sizeof(Definition));
+
+  self->name = Arena_strdup(arena, name);
+  self->value = Arena_strdup(arena, value);
+
+  return self;
+}
+
+static uint32_t StringList_hash(const char* name) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  
+  while(*name) {
+    hash ^= (uint8_t) *name++;
+    hash *= 16777619u;
   }
+  return hash;
 }
 
-Definition *Definition_new(const char* name, const char* value) {
-  Definition* self = (Definition*) calloc(1, sizeof(Definition));
+static Definition** StringList_find_slot(StringList *self, const char* name) {
+  uint32_t mask = self->index_size-1;
+  uint32_t i = StringList_hash(name) & mask;
 
-  self->name = (char*) calloc(strlen(name)+1, sizeof(char));
-  strncpy(self->name, name, strlen(name)+1);
+  while(self->index[i] != NULL &&
+        strcmp(self->index[i]->name, name) != 0) {
+    i = (i+1) & mask;
+  }
+  return &self->index[i];
+}
 
-  self->value = (char*) calloc(strlen(value)+1, sizeof(char));
-  strncpy(self->value, value, strlen(value)+1);
+static void StringList_grow_index(StringList *self) {
+  self->index_size = self->index_size ? self->index_size*2 : 64;
 
-  return self;
-}
+  // the old table simply stays in the arena
+  self->index = (Definition**) Arena_alloc(self->arena, self->index_size * sizeof(Definition*));
+  memset(self->index, 0, self->index_size * sizeof(Definition*));
 
-bool StringList_add_definition(const char* name, const char* value) {
+  for(int i=0; i<self->num_definitions; i++) {
+    *StringList_find_slot(self, self->definitions[i]->name) = self->definitions[i];
+  }
+}
 
-  if(StringList_has_definition(name)) {
+bool StringList_add_definition(StringList *self, const char* name, const char* value) {
+  Definition **definitions;
+  
+  if(StringList_has_definition(self, name)) {
     return false;
   }
-  Definition* definition = Definition_new(name, value);
-
-  StringList_definitions =
-    (Definition**) realloc(StringList_definitions,
-                           (StringList_num_definitions+1) * sizeof(Definition*));
+  Definition* definition = Definition_new(self->arena, name, value);
 
-  StringList_definitions[StringList_num_definitions] = definition;
+  if(self->num_definitions == self->definitions_capacity) {
+    self->definitions_capacity = self->definitions_capacity ? self->definitions_capacity*2 : 64;
+    definitions = (Definition**) Arena_alloc(self->arena, self->definitions_capacity * sizeof(Definition*));
+    if(self->num_definitions) {
+      memcpy(definitions, self->definitions, self->num_definitions * sizeof(Definition*));
+    }
+    self->definitions = definitions;
+  }
+  self->definitions[self->num_definitions++] = definition;
 
-  StringList_num_definitions++;
+  if(self->num_definitions*2 > self->index_size) {
+    StringList_grow_index(self);
+  }
+  else {
+    *StringList_find_slot(self, name) = definition;
+  }
   return true;
 }
 
-bool StringList_has_definition(const char* name) {
-  return StringList_get_definition(name) != NULL;
+bool StringList_has_definition(StringList *self, const char* name) {
+  return StringList_get_definition(self, name) != NULL;
 }
 
-Definition* StringList_get_definition(const char* name) {
-  Definition* definition;
-  for(int i=0; i<StringList_num_definitions; i++) {
-    definition = StringList_definitions[i];
-    if(strcmp(definition->name, name) == 0) {
-      return definition;
-    }
+Definition* StringList_get_definition(StringList *self, const char* name) {
+  if(self->index_size == 0) {
+    return NULL;
   }
-  return NULL;
+  return *StringList_find_slot(self, name);
+}
+
+// Everything allocated while parsing is only needed until the parse is
+// done, so it comes from an arena: large blocks, handed out in pieces
+// and freed all at once.
+
+unsigned long Arena_allocations = 0;
+unsigned long Arena_blocks = 0;
+
+Arena* Arena_new(void) {
+  return (Arena*) calloc(1, sizeof(Arena));
+}
+
+void* Arena_alloc(Arena *self, size_t size) {
+  ArenaBlock *block = self->blocks;
+  size_t capacity;
+  void *result;
+
+  size = (size + sizeof(void*)-1) & ~(sizeof(void*)-1);
+  
+  if(block == NULL || block->used + size > block->size) {
+    capacity = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+    block = (ArenaBlock*) malloc(sizeof(ArenaBlock) + capacity);
+    block->size = capacity;
+    block->used = 0;
+    block->next = self->blocks;
+    self->blocks = block;
+    self->num_blocks++;
+  }
+  result = block->data + block->used;
+  block->used += size;
+  self->allocations++;
+  return result;
+}
+
+char* Arena_strdup(Arena *self, const char *string) {
+  size_t len = strlen(string)+1;
+  return (char*) memcpy(Arena_alloc(self, len), string, len);
 }
 
-StringList *StringList_new(void) {
-  StringList_init();
+void Arena_free(Arena *self) {
+  ArenaBlock *next;
   
-  StringList *stringlist = (StringList*) calloc(1, sizeof(StringList));
-  stringlist->size = 0;
-  stringlist->strings = (char**) NULL;  
+  for(ArenaBlock *block = self->blocks; block != NULL; block = next) {
+    next = block->next;
+    free(block);
+  }
+
+  // arenas may be freed by several threads at once
+  __sync_fetch_and_add(&Arena_allocations, self->allocations);
+  __sync_fetch_and_add(&Arena_blocks, self->num_blocks);
+  free(self);
+}
+
+StringList *StringList_new(Arena *arena) {
+  StringList *stringlist = (StringList*) Arena_alloc(arena, sizeof(StringList));
+  memset(stringlist, 0, sizeof(StringList));
+  stringlist->arena = arena;
   return stringlist;
 }
 
 void StringList_append(StringList *self, const char *string, const char* delim) {  
+  char **strings;
 
-  if(StringList_has_definition(string)) {
-    StringList_append_tokenized(self, StringList_get_definition(string)->value, delim);
+  if(StringList_has_definition(self, string)) {
+    StringList_append_tokenized(self, StringList_get_definition(self, string)->value, delim);
   }
   else {
-    self->strings = (char**) realloc(self->strings, (self->size+1) * sizeof(char *));
-    self->strings[self->size] = calloc(strlen(string)+1, sizeof(char));
-    strncpy(self->strings[self->size], string, strlen(string));
+    // Grow geometrically, the old array simply stays in the arena
+    if(self->size == self->capacity) {
+      self->capacity = self->capacity ? self->capacity*2 : 64;
+      strings = (char**) Arena_alloc(self->arena, self->capacity * sizeof(char *));
+      if(self->size) {
+        memcpy(strings, self->strings, self->size * sizeof(char *));
+      }
+      self->strings = strings;
+    }
+    self->strings[self->size] = Arena_strdup(self->arena, string);
     self->size++;
   }
 }
@@ -126,8 +218,7 @@ void StringList_append_tokenized(StringList *self, const char* input, const char
   char *substring;
   char *saveptr;
   
-  char *string = (char*) calloc(strlen(input)+1, sizeof(char));
-  strncpy(string, input, strlen(input));
+  char *string = Arena_strdup(self->arena, input);
   
   if((substring = strtok_r(string, delim, &saveptr)) != NULL) {
     StringList_append(self, substring, delim);
@@ -136,57 +227,6 @@ void StringList_append_tokenized(StringList *self, const char* input, const char
       StringList_append(self, substring, delim);
     } 
   }
-  free(string);
-}
-
-void StringList_append_quoted(StringList *self, const char* input, const char *delim) {
-
-  bool literal = false;
-  bool escaped = false;
-
-  char *token = (char *) calloc(4096, sizeof(char));
-  int pos = 0;
-  char c;
-  
-  for(int i=0; i<strlen(input); i++) {
-    c = input[i];
-    
-    if(c == '\\' && !escaped) {
-      escaped = true;
-      continue;
-    }
-    
-    if(c == '"' && !escaped) {
-      literal = !literal;
-      if(!literal) {
-        StringList_append(self, token, delim);
-        token[pos=0] = '\0';
-        continue;
-      }
-    }
-
-    if((!literal) && (strchr(delim, c) != NULL)) {      
-      if(strlen(token)) {
-        StringList_append(self, token, delim);
-        token[pos=0] = '\0';
-      }
-      continue;
-    }
-    
-    pos = strlen(token);
-    token[pos] = c;
-    token[pos+1] = '\0';
-
-    if(escaped) {
-      escaped = false;
-    }
-  }
-  
-  if(strlen(token)) {
-    StringList_append(self, token, delim);
-    token[pos=0] = '\0';
-  }  
-  free(token);
 }
 
 char* StringList_get(StringList *self, int index) {
@@ -201,15 +241,7 @@ char* StringList_last(StringList *self) {
 }
 
 void StringList_remove_last(StringList *self) {
-  free(self->strings[--self->size]);
-}
-
-void StringList_free(StringList *self) {
-  for(int i=0; i<self->size; i++) {
-    free(self->strings[i]);
-  }
-  free(self->strings);
-  free(self);
+  self->size--;
 }
 
 void StringList_debug(StringList *self) {
@@ -218,9 +250,9 @@ void StringList_debug(StringList *self) {
     fprintf(stderr, "%02d: [%s]\n", i, self->strings[i]);
   }
 
-  for(int i=0; i<StringList_num_definitions; i++) {
+  for(int i=0; i<self->num_definitions; i++) {
     fprintf(stderr, "[%s] = [%s]\n",
-            StringList_definitions[i]->name, StringList_definitions[i]->value);
+            self->definitions[i]->name, self->definitions[i]->value);
   }
 }
 
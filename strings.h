@@ -20,30 +20,59 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define STRINGS_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size;
+  size_t used;
+  char data[];
+} ArenaBlock;
 
 typedef struct {
-  int size;
-  char **strings;
-} StringList;
+  ArenaBlock *blocks;
+  unsigned long allocations;
+  unsigned long num_blocks;
+} Arena;
+
+extern unsigned long Arena_allocations; // served by all freed arenas
+extern unsigned long Arena_blocks;      // taken from the heap for them
 
 typedef struct {
   char* name;
   char* value;
 } Definition;
 
-void StringList_init(void);
-bool StringList_add_definition(const char* name, const char* value);
-bool StringList_has_definition(const char* name);
-Definition* StringList_get_definition(const char* name);
+typedef struct {
+  int size;
+  int capacity;
+  char **strings;
+  Arena *arena;
+
+  Definition **definitions; // expanded when appended
+  int num_definitions;
+  int definitions_capacity;
+  Definition **index;
+  uint32_t index_size;
+} StringList;
+
+Arena* Arena_new(void);
+void* Arena_alloc(Arena *self, size_t size);
+char* Arena_strdup(Arena *self, const char *string);
+void Arena_free(Arena *self);
 
-StringList *StringList_new(void);
+StringList *StringList_new(Arena *arena);
+bool StringList_add_definition(StringList *self, const char* name, const char* value);
+bool StringList_has_definition(StringList *self, const char* name);
+Definition* StringList_get_definition(StringList *self, const char* name);
 void StringList_append(StringList *self, const char *string, const char *delim);
 void StringList_append_tokenized(StringList *self, const char* input, const char *delim);
-void StringList_append_quoted(StringList *self, const char* input, const char *delim);
 char* StringList_get(StringList *self, int index);
 char* StringList_last(StringList *self);
 void StringList_remove_last(StringList *self);
-void StringList_free(StringList *self);
 void StringList_debug(StringList *self);
 
 char* trim(char* s);
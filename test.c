@@ -33,11 +33,14 @@ void putbyte(uint8_t byte) {
 }
 
 int main(int argc, char **argv) {
-  config = Config_new();
+  uint8_t ports[5] = { 0xff, 0xff, 0xff, 0xff, 0xff }; // all lines idle
 
-  Config_parse(config, stdin);
+  config = Config_new_with_ports(&ports[0], &ports[1], &ports[2], &ports[3], &ports[4]);
 
-  Config_apply(config);
+  Config_parse(config, stdin, NULL);
+
+  Config_setup(config);
+  Config_apply(config, NULL);
   
   for(int line=0; line<SCREEN_ROWS*CHAR_HEIGHT; line++) {
 
@@ -47,7 +50,7 @@ int main(int argc, char **argv) {
     if(row == NULL) continue;
 
     for(int col=0; col<SCREEN_COLUMNS; col++) {
-      putbyte(font[row[col]*CHAR_HEIGHT+byte]);
+      putbyte(_font[row[col]*CHAR_HEIGHT+byte]);
     }
     printf("\n");
   }
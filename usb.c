@@ -21,19 +21,41 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #include "usb.h"
 #include "target.h"
 
+__thread bool usb_quiet = false;
+
 //-----------------------------------------------------------------------------
 // USB device discovery & handling
 //-----------------------------------------------------------------------------
 
+static void usb_port(libusb_device *device, char *port, int size) {
+
+  uint8_t numbers[7];
+  int depth = libusb_get_port_numbers(device, numbers, sizeof(numbers));
+  int len = snprintf(port, size, "%d", libusb_get_bus_number(device));
+
+  for(int i=0; i<depth && len<size; i++) {
+    len += snprintf(port+len, size-len, "%c%d", i ? '.' : '-', numbers[i]);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
 static bool usb_lookup(DeviceInfo *info) {
 
   info->bus     = -1;
   info->address = -1;
   info->serial  = NULL;
+
+  // The address changes whenever the device resets, the port it is
+  // plugged into doesn't
+  if(info->port[0] != '\0') {
+    return true;
+  }
   
 #if linux
 
@@ -80,6 +102,7 @@ static libusb_device_handle* usb_open(libusb_context* context, DeviceInfo *info)
   libusb_device_handle* handle = NULL;
   
   char serial[256];
+  char port[32];
   int result;
   int i = 0;
 
@@ -103,6 +126,13 @@ static libusb_device_handle* usb_open(libusb_context* context, DeviceInfo *info)
     
     if(descriptor.idVendor == info->vid &&
        descriptor.idProduct == info->pid) {
+
+      if(info->port[0] != '\0') {
+        usb_port(device, port, sizeof(port));
+        if(strcmp(port, info->port) != 0) {
+          continue;
+        }
+      }
       
       if(info->bus > -1) {
         if(libusb_get_bus_number(device) != info->bus) {
@@ -173,53 +203,499 @@ static libusb_device_handle* usb_open(libusb_context* context, DeviceInfo *info)
   return handle;
 }
 
+//-----------------------------------------------------------------------------
+// libusb transport
 //-----------------------------------------------------------------------------
 
-static int usb_message(DeviceInfo *info, int direction, uint8_t message, uint16_t value, uint16_t index, uint8_t* buf, uint16_t size) {
+// A libusb context is kept per thread for the whole run, and each device
+// keeps its handle open until it is closed explicitly or turns out to
+// be gone, so consecutive transfers don't have to enumerate the bus.
+
+static __thread libusb_context *usb_context = NULL;
+
+static bool usb_unchanged(DeviceInfo *info);
+static bool usb_poll(DeviceInfo *info, int timeout);
+
+static bool usb_init(void) {
 
-  libusb_device_handle *handle = NULL;
   int result;
+
+  if(usb_context != NULL) return true;
   
-  if((result = libusb_init(NULL)) < 0) {
+  if((result = libusb_init(&usb_context)) < 0) {
+    usb_context = NULL;
     if(!usb_quiet) {
       fprintf(stderr, "error: could not initialize libusb-1.0: %s\n",
               libusb_strerror(result));
     }
-    goto done;
+    return false;
   }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+static void usb_libusb_exit(void) {
+  if(usb_context != NULL) {
+    libusb_exit(usb_context);
+    usb_context = NULL;
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+static bool usb_libusb_open(DeviceInfo *info) {
 
+  if(!usb_init()) {
+    return false;
+  }
+  
   usb_lookup(info);
-  handle = usb_open(NULL, info);
+  info->handle = usb_open(usb_context, info);
+  return info->handle != NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+static void usb_libusb_close(DeviceInfo *info) {
+  libusb_close((libusb_device_handle *) info->handle);
+}
+
+//-----------------------------------------------------------------------------
+
+static bool usb_libusb_alive(DeviceInfo *info) {
+
+  uint8_t status[2];
   
-  if(handle == NULL) {
-    result = -1;
+  return libusb_control_transfer((libusb_device_handle *) info->handle,
+                                 LIBUSB_ENDPOINT_IN |
+                                 LIBUSB_REQUEST_TYPE_STANDARD |
+                                 LIBUSB_RECIPIENT_DEVICE,
+                                 LIBUSB_REQUEST_GET_STATUS, 0, 0,
+                                 status, sizeof(status), 1000) >= 0;
+}
+
+//-----------------------------------------------------------------------------
+
+static int usb_libusb_control(DeviceInfo *info, uint8_t type, uint8_t message,
+                              uint16_t value, uint16_t index,
+                              uint8_t *buf, uint16_t size, unsigned int timeout) {
+  
+  return libusb_control_transfer((libusb_device_handle *) info->handle,
+                                 type, message, value, index, buf, size, timeout);
+}
+
+//-----------------------------------------------------------------------------
+
+static int usb_libusb_claim(DeviceInfo *info, int interface, bool claim) {
+
+  return claim ?
+    libusb_claim_interface((libusb_device_handle *) info->handle, interface) :
+    libusb_release_interface((libusb_device_handle *) info->handle, interface);
+}
+
+//-----------------------------------------------------------------------------
+
+static int usb_libusb_interrupt(DeviceInfo *info, uint8_t endpoint,
+                                uint8_t *buf, uint16_t size, unsigned int timeout) {
+  int transferred;
+  int result;
+  
+  result = libusb_interrupt_transfer((libusb_device_handle *) info->handle,
+                                     endpoint, buf, size, &transferred, timeout);
+  return (result < 0) ? result : transferred;
+}
+
+//-----------------------------------------------------------------------------
+
+static int usb_libusb_enumerate(DeviceInfo *match, DeviceInfo *devices, int max) {
+
+  libusb_device **list;
+  libusb_device *device;
+  libusb_device_handle *handle;
+  struct libusb_device_descriptor descriptor;
+  DeviceInfo *info;
+  char serial[256];
+  int count = 0;
+  int result;
+
+  if(!usb_init()) {
+    return -1;
+  }
+  
+  if((result = libusb_get_device_list(usb_context, &list)) < 0) {
+    fprintf(stderr, "error: could not get usb device list: %s\n",
+            libusb_strerror(result));
+    return -1;
+  }
+
+  for(int i=0; (device = list[i]) != NULL && count < max; i++) {
+
+    if(libusb_get_device_descriptor(device, &descriptor) < 0) {
+      continue;
+    }
+
+    if(descriptor.idVendor != match->vid ||
+       descriptor.idProduct != match->pid) {
+      continue;
+    }
+
+    info = &devices[count++];
+    memcpy(info, match, sizeof(DeviceInfo));
+
+    info->bus = libusb_get_bus_number(device);
+    info->address = libusb_get_device_address(device);
+    info->serial = NULL;
+    info->handle = NULL;
+    usb_port(device, info->port, sizeof(info->port));
+    snprintf(info->path, sizeof(info->path), "%03d/%03d", info->bus, info->address);
+
+    if(descriptor.iSerialNumber != 0 && libusb_open(device, &handle) == 0) {
+      if(libusb_get_string_descriptor_ascii(handle, descriptor.iSerialNumber,
+                                            (unsigned char *) serial, sizeof(serial)) > 0) {
+        info->serial = strdup(serial);
+      }
+      libusb_close(handle);
+    }
+  }
+  
+  libusb_free_device_list(list, true);
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct {
+  DeviceInfo *info;
+  bool arrived;
+  bool left;
+} UsbEvents;
+
+static int usb_hotplug(libusb_context *context, libusb_device *device,
+                       libusb_hotplug_event event, void *data) {
+
+  UsbEvents *events = (UsbEvents *) data;
+  char port[32];
+
+  // Other devices of the same kind may come and go at the same time
+  if(events->info->port[0] != '\0') {
+    usb_port(device, port, sizeof(port));
+    if(strcmp(port, events->info->port) != 0) {
+      return 0;
+    }
+  }
+  
+  if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) events->arrived = true;
+  if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) events->left = true;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool usb_libusb_wait(DeviceInfo *info, int timeout) {
+
+  UsbEvents events = { info, false, false };
+  libusb_hotplug_callback_handle callback;
+  struct timeval tick = { 0, 10000 };
+  bool present;
+  bool result = false;
+
+  // Prefer being notified by libusb over polling the bus
+  if(!usb_init() || !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    return usb_poll(info, timeout);
+  }
+  
+  if(libusb_hotplug_register_callback(usb_context,
+                                      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                      LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                      LIBUSB_HOTPLUG_NO_FLAGS,
+                                      info->vid, info->pid,
+                                      LIBUSB_HOTPLUG_MATCH_ANY,
+                                      usb_hotplug, &events,
+                                      &callback) != LIBUSB_SUCCESS) {
+    return usb_poll(info, timeout);
+  }
+
+  // A device that still answers is about to reset, so it has to go
+  // away before we can wait for it to come back. Any event from here on
+  // means it did, even if it is back before we get to see it leave.
+  // Otherwise it may have come back before we started listening, so
+  // look for it right away rather than wait to see it arrive.
+  if(!(present = usb_unchanged(info))) {
+    events.arrived = true;
+  }
+  
+  for(int i=0; i<timeout/10; i++) {
+
+    libusb_handle_events_timeout_completed(usb_context, &tick, NULL);
+
+    if(present) {
+      if(events.left || events.arrived) {
+        usb_close(info);
+        present = false;
+      }
+      else continue;
+    }
+
+    // The device may take a moment to become accessible after it has
+    // arrived, so keep trying until it can be opened
+    if(events.arrived) {
+      if((result = usb_ping(info))) {
+        break;
+      }
+    }
+  }
+  
+  libusb_hotplug_deregister_callback(usb_context, callback);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+typedef struct {
+  struct libusb_transfer *transfer;
+  uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE+255];
+  int chunk;  // chunk held by this slot, -1 if free
+  bool busy;  // still in flight
+  bool ok;
+} UsbSlot;
+
+static void LIBUSB_CALL usb_stream_done(struct libusb_transfer *transfer) {
+
+  UsbSlot *slot = (UsbSlot *) transfer->user_data;
+
+  slot->ok = transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+    transfer->actual_length == transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+  slot->busy = false;
+}
+
+//-----------------------------------------------------------------------------
+
+static int usb_libusb_stream(DeviceInfo *info, UsbChunk *chunks, int count, int depth, int retries,
+                             void (*progress)(int bytes, void *context), void *context) {
+
+  libusb_device_handle *handle = (libusb_device_handle *) info->handle;
+  UsbSlot *slots = NULL;
+  int *attempts = NULL;
+  bool *acked = NULL;
+  struct timeval tick = { 1, 0 };
+  int next = 0;       // next chunk to submit
+  int completed = 0;  // all chunks before this one have been acknowledged
+  int pending = 0;    // transfers in flight
+  int error = -1;     // earliest chunk that failed
+  int bytes = 0;
+  int result = -1;
+
+  slots = (UsbSlot *) calloc(depth, sizeof(UsbSlot));
+  attempts = (int *) calloc(count, sizeof(int));
+  acked = (bool *) calloc(count, sizeof(bool));
+
+  for(int i=0; i<depth; i++) {
+    slots[i].chunk = -1;
+    if((slots[i].transfer = libusb_alloc_transfer(0)) == NULL) {
+      fprintf(stderr, "error: could not allocate usb transfer\n");
+      goto done;
+    }
+  }
+
+  // Keep up to depth control transfers queued on the default pipe. They
+  // are carried out in order, so the device never has to wait for the
+  // host to turn around between two chunks.
+  while(completed < count) {
+
+    for(int i=0; i<depth && next<count && error<0; i++) {
+      UsbChunk *chunk = &chunks[next];
+
+      if(slots[i].chunk >= 0) continue;
+      
+      libusb_fill_control_setup(slots[i].buffer,
+                                LIBUSB_REQUEST_TYPE_VENDOR |
+                                LIBUSB_RECIPIENT_DEVICE |
+                                (chunk->in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT),
+                                chunk->message, chunk->value, chunk->index,
+                                chunk->size);
+      if(!chunk->in) {
+        memcpy(slots[i].buffer+LIBUSB_CONTROL_SETUP_SIZE, chunk->buf, chunk->size);
+      }
+      libusb_fill_control_transfer(slots[i].transfer, handle, slots[i].buffer,
+                                   usb_stream_done, &slots[i], USB_TIMEOUT);
+      
+      if(libusb_submit_transfer(slots[i].transfer) < 0) {
+        error = next;
+        break;
+      }
+      slots[i].chunk = next++;
+      slots[i].busy = true;
+      pending++;
+    }
+
+    if(pending) {
+      libusb_handle_events_timeout_completed(usb_context, &tick, NULL);
+    }
+    
+    for(int i=0; i<depth; i++) {
+      if(slots[i].chunk < 0 || slots[i].busy) continue;
+
+      if(slots[i].ok) {
+        UsbChunk *chunk = &chunks[slots[i].chunk];
+        
+        if(chunk->in) {
+          memcpy(chunk->buf, libusb_control_transfer_get_data(slots[i].transfer), chunk->size);
+        }
+        acked[slots[i].chunk] = true;
+      }
+      else if(error < 0 || slots[i].chunk < error) {
+        error = slots[i].chunk;
+      }
+      slots[i].chunk = -1;
+      pending--;
+    }
+
+    while(completed < count && acked[completed]) {
+      bytes += chunks[completed++].size;
+    }
+    
+    if(progress != NULL) {
+      progress(bytes, context);
+    }
+    
+    if(error < 0) continue;
+
+    // Everything queued after a failed chunk has to be dropped before
+    // anything can be resent, so cancel it and wait for the pipe to drain
+    if(pending) {
+      for(int i=0; i<depth; i++) {
+        if(slots[i].busy) libusb_cancel_transfer(slots[i].transfer);
+      }
+      continue;
+    }
+
+    if(++attempts[error] > retries) {
+      fprintf(stderr, "\nerror: usb transfer failed %d times, giving up\n",
+              attempts[error]);
+      goto done;
+    }
+
+    // Chunks that depend on each other, like parts of the same flash
+    // page, have to be sent again together
+    next = chunks[error].restart;
+    for(int i=next; i<count; i++) {
+      acked[i] = false;
+    }
+    completed = bytes = 0;
+    error = -1;
+  }
+  result = bytes;
+  
+ done:
+  for(int i=0; i<depth; i++) {
+    if(slots[i].transfer != NULL) {
+      libusb_free_transfer(slots[i].transfer);
+    }
+  }
+  free(slots);
+  free(attempts);
+  free(acked);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+UsbTransport usb_libusb = {
+  .name      = "libusb",
+  .exit      = usb_libusb_exit,
+  .enumerate = usb_libusb_enumerate,
+  .open      = usb_libusb_open,
+  .close     = usb_libusb_close,
+  .alive     = usb_libusb_alive,
+  .control   = usb_libusb_control,
+  .claim     = usb_libusb_claim,
+  .interrupt = usb_libusb_interrupt,
+  .wait      = usb_libusb_wait,
+  .stream    = usb_libusb_stream,
+};
+
+//-----------------------------------------------------------------------------
+// USB session handling
+//-----------------------------------------------------------------------------
+
+// Everything below goes through the transport, which talks to real
+// devices via libusb unless another one has been plugged in
+
+static UsbTransport *usb_transport = &usb_libusb;
+
+void usb_set_transport(UsbTransport *transport) {
+  usb_transport = transport;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool usb_connect(DeviceInfo *info) {
+
+  if(info->handle != NULL) {
+    return true;
+  }
+
+  if(!usb_transport->open(info)) {
+    info->handle = NULL;
+    
     if(!usb_quiet) {
       fprintf(stderr, "error: could not open usb device \"%s\"\n", info->path);
     }
-    goto done;
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void usb_close(DeviceInfo *info) {
+  if(info->handle != NULL) {
+    usb_transport->close(info);
+    info->handle = NULL;
   }
+}
+
+//-----------------------------------------------------------------------------
 
-  result = libusb_control_transfer(handle,
-                                   LIBUSB_REQUEST_TYPE_VENDOR |
-                                   LIBUSB_RECIPIENT_DEVICE |
-                                   direction,
-                                   message, value, index,
-                                   buf, size, 5000);
+void usb_exit(void) {
+  usb_transport->exit();
+}
+
+//-----------------------------------------------------------------------------
+
+static int usb_message(DeviceInfo *info, int direction, uint8_t message, uint16_t value, uint16_t index, uint8_t* buf, uint16_t size, unsigned int timeout) {
+
+  int result = -1;
+  
+  for(int attempt=0; attempt<2; attempt++) {
+  
+    if(!usb_connect(info)) {
+      return -1;
+    }
+
+    result = usb_transport->control(info,
+                                    LIBUSB_REQUEST_TYPE_VENDOR |
+                                    LIBUSB_RECIPIENT_DEVICE |
+                                    direction,
+                                    message, value, index,
+                                    buf, size, timeout);
+
+    // The device has been reset or re-enumerated since the handle was
+    // opened, so drop it and try once more with a fresh one
+    if(result == LIBUSB_ERROR_NO_DEVICE) {
+      usb_close(info);
+      continue;
+    }
+    break;
+  }
   
   if(result < 0) {
     if(!usb_quiet) {
       fprintf(stderr, "error: could not send usb control message: %s\n",
               libusb_strerror(result));
     }
-    goto done;
-  }
-
- done:
-  if(handle != NULL) {
-    libusb_close(handle);
   }
-  libusb_exit(NULL);
-  
   return result;    
 }
 
@@ -227,48 +703,235 @@ static int usb_message(DeviceInfo *info, int direction, uint8_t message, uint16_
 // USB utility functions
 //-----------------------------------------------------------------------------
 
+int usb_enumerate(DeviceInfo *match, DeviceInfo *devices, int max) {
+  return usb_transport->enumerate(match, devices, max);
+}
+
+//-----------------------------------------------------------------------------
+
 bool usb_ping(DeviceInfo *info) {   
   
-  libusb_device_handle *handle = NULL;
   bool result = false;
   bool quiet = usb_quiet;
   usb_quiet = true;
+
+  // A cached handle may have gone stale if the device has been reset,
+  // so make sure it still answers before relying on it
+  if(info->handle != NULL && !usb_transport->alive(info)) {
+    usb_close(info);
+  }
+  result = usb_connect(info);
   
-  if(libusb_init(NULL) < 0) {
-    fprintf(stderr, "error: could not initialize libusb-1.0: %s\n",
-            libusb_strerror(result));
-    goto done;
+  usb_quiet = quiet;
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool usb_unchanged(DeviceInfo *info) {
+
+  // Only the handle the request was sent through tells whether the
+  // device is still the same. Once that has gone stale, the device has
+  // reset and may already be back under a new address, and without one
+  // it can only have arrived since.
+  if(info->handle != NULL && usb_transport->alive(info)) {
+    return true;
   }
-  usb_lookup(info);
-  handle = usb_open(NULL, info);
-  result = handle != NULL;
+  usb_close(info);
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool usb_poll(DeviceInfo *info, int timeout) {
+
+  // A device that still answers is about to reset, so it has to go
+  // away before we can wait for it to come back
+  bool present = usb_unchanged(info);
   
- done:
-  if(handle != NULL) {
-    libusb_close(handle);
+  for(int i=0; i<timeout/10; i++) {
+
+    usleep(10000);
+    
+    if(present) {
+      present = usb_unchanged(info);
+      continue;
+    }
+
+    if(usb_ping(info)) {
+      return true;
+    }
   }
-  libusb_exit(NULL);
+  return false;
+}
 
-  usb_quiet = quiet;
-  return result;
+//-----------------------------------------------------------------------------
+
+bool usb_wait(DeviceInfo *info, int timeout) {
+  return (usb_transport->wait != NULL) ?
+    usb_transport->wait(info, timeout) :
+    usb_poll(info, timeout);
 }
 
 //-----------------------------------------------------------------------------
 
 int usb_control(DeviceInfo *info, uint8_t message) {
-  return usb_message(info, LIBUSB_ENDPOINT_OUT, message, 0, 0, NULL, 0);  
+  return usb_message(info, LIBUSB_ENDPOINT_OUT, message, 0, 0, NULL, 0, USB_TIMEOUT);
 }
 
 //-----------------------------------------------------------------------------
 
 int usb_send(DeviceInfo *info, uint8_t message, uint16_t value, uint16_t index, uint8_t* buf, uint16_t size) {
-  return usb_message(info, LIBUSB_ENDPOINT_OUT, message, value, 0, buf, size);  
+  return usb_message(info, LIBUSB_ENDPOINT_OUT, message, value, index, buf, size, USB_TIMEOUT);
+}
+
+//-----------------------------------------------------------------------------
+
+int usb_send_slow(DeviceInfo *info, uint8_t message, uint16_t value, uint16_t index, uint8_t* buf, uint16_t size, unsigned int timeout) {
+  return usb_message(info, LIBUSB_ENDPOINT_OUT, message, value, index, buf, size, timeout);
 }
 
 //-----------------------------------------------------------------------------
 
 int usb_receive(DeviceInfo* info, uint8_t message, uint16_t value, uint16_t index, uint8_t* buf, uint16_t size) {
-  return usb_message(info, LIBUSB_ENDPOINT_IN, message, value, index, buf, size); 
+  return usb_message(info, LIBUSB_ENDPOINT_IN, message, value, index, buf, size, USB_TIMEOUT);
+}
+
+//-----------------------------------------------------------------------------
+
+int usb_write_text(DeviceInfo *info, uint8_t message, TextUpdate *updates, int count) {
+
+  uint8_t buf[255];
+  uint16_t size = 0;
+  int len;
+  int sent = 0;
+  
+  // Pack as many (row, col, len, text) records into each transfer as
+  // will fit, so that a batch of updates costs as few round trips as
+  // possible
+  for(int i=0; i<=count; i++) {
+
+    len = (i < count) ? strlen(updates[i].text) : 0;
+    if(len > sizeof(buf)-3) len = sizeof(buf)-3;
+    
+    if(size && (i == count || size+3+len > sizeof(buf))) {
+      if(usb_send(info, message, 0, 0, buf, size) != size) {
+        return -1;
+      }
+      sent = i;
+      size = 0;
+    }
+    if(i == count) break;
+    
+    buf[size++] = updates[i].row;
+    buf[size++] = updates[i].col;
+    buf[size++] = len;
+    memcpy(buf+size, updates[i].text, len);
+    size += len;
+  }
+  return sent;
+}
+
+//-----------------------------------------------------------------------------
+
+int usb_listen(DeviceInfo *info, uint8_t endpoint, uint8_t *buf, uint16_t size,
+               bool (*callback)(uint8_t *buf, int len, void *context), void *context) {
+
+  bool claimed = false;
+  int result;
+  
+  if(!usb_connect(info)) {
+    result = -1;
+    goto done;
+  }
+
+  if(usb_transport->claim != NULL) {
+    if((result = usb_transport->claim(info, 0, true)) < 0) {
+      fprintf(stderr, "error: could not claim usb interface: %s\n",
+              libusb_strerror(result));
+      goto done;
+    }
+    claimed = true;
+  }
+
+  // Keep reading until the callback asks to stop. The callback is also
+  // invoked without data whenever a read times out, so that it gets a
+  // chance to stop even if the device has nothing to report.
+  while(true) {
+    result = usb_transport->interrupt(info, endpoint, buf, size, 250);
+
+    if(result == LIBUSB_ERROR_TIMEOUT) {
+      if(!callback(NULL, 0, context)) break;
+      continue;
+    }
+    
+    if(result < 0) {
+      fprintf(stderr, "error: could not read from usb endpoint: %s\n",
+              libusb_strerror(result));
+      goto done;
+    }
+
+    if(!callback(buf, result, context)) break;
+  }
+  result = 0;
+  
+ done:
+  if(claimed) {
+    usb_transport->claim(info, 0, false);
+  }
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+
+static int usb_stream_serial(DeviceInfo *info, UsbChunk *chunks, int count, int retries,
+                             void (*progress)(int bytes, void *context), void *context) {
+
+  int *attempts = (int *) calloc(count, sizeof(int));
+  int bytes = 0;
+  int result;
+  
+  for(int i=0; i<count; ) {
+    result = usb_message(info, chunks[i].in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT,
+                         chunks[i].message, chunks[i].value, chunks[i].index,
+                         chunks[i].buf, chunks[i].size, USB_TIMEOUT);
+
+    if(result != chunks[i].size) {
+      if(++attempts[i] > retries) {
+        fprintf(stderr, "\nerror: usb transfer failed %d times, giving up\n", attempts[i]);
+        free(attempts);
+        return -1;
+      }
+      for(int k=chunks[i].restart; k<i; k++) {
+        bytes -= chunks[k].size;
+      }
+      i = chunks[i].restart;
+      continue;
+    }
+
+    bytes += chunks[i++].size;
+    
+    if(progress != NULL) {
+      progress(bytes, context);
+    }
+  }
+  free(attempts);
+  return bytes;
+}
+
+//-----------------------------------------------------------------------------
+
+int usb_stream(DeviceInfo *info, UsbChunk *chunks, int count, int depth, int retries,
+               void (*progress)(int bytes, void *context), void *context) {
+
+  if(!usb_connect(info)) {
+    return -1;
+  }
+
+  // Transports that can't queue transfers send one chunk at a time
+  return (usb_transport->stream != NULL) ?
+    usb_transport->stream(info, chunks, count, depth, retries, progress, context) :
+    usb_stream_serial(info, chunks, count, retries, progress, context);
 }
 
 //-----------------------------------------------------------------------------
@@ -27,7 +27,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define USBASP_VID 0x16c0
 #define USBASP_PID 0x05dc
 
-bool usb_quiet;
+#define USBASP_CONNECT     1
+#define USBASP_WRITEFLASH  6
+#define USBASP_READFLASH   4
+#define USBASP_ENABLEPROG  5
+#define USBASP_READEEPROM  7
+#define USBASP_WRITEEEPROM 8
+#define USBASP_DISCONNECT  2
+#define USBASP_SETLONGADDRESS 9
+
+#define USBASP_PAGE_SIZE   256    // SPM page size of the ATmega1284
+
+#define USB_TIMEOUT 5000 // ms, for requests the device answers right away
+
+extern __thread bool usb_quiet;
 
 typedef struct {
   char path[4096];
@@ -37,11 +50,65 @@ typedef struct {
   int bus;
   int address;
   char *serial;
+  char port[32]; // physical port, identifies the device across resets
+  void *handle; // transport specific, kept open for the whole session
 } DeviceInfo;
 
+typedef struct {
+  uint8_t row;
+  uint8_t col;
+  char *text;
+} TextUpdate;
+
+typedef struct {
+  uint8_t message;
+  uint16_t value;
+  uint16_t index;
+  uint8_t *buf;
+  uint16_t size;
+  bool in;     // read into buf instead of sending it
+  int restart; // chunk to resend from should this one fail
+} UsbChunk;
+
+// A transport carries the vendor requests to the device. Besides the
+// libusb one talking to real hardware, others may be plugged in, e.g.
+// to emulate devices in-process. Optional functions may be NULL.
+
+typedef struct {
+  const char *name;
+  void (*exit)(void);
+  int  (*enumerate)(DeviceInfo *match, DeviceInfo *devices, int max);
+  bool (*open)(DeviceInfo *info);
+  void (*close)(DeviceInfo *info);
+  bool (*alive)(DeviceInfo *info);
+  int  (*control)(DeviceInfo *info, uint8_t type, uint8_t message,
+                  uint16_t value, uint16_t index,
+                  uint8_t *buf, uint16_t size, unsigned int timeout);
+  int  (*claim)(DeviceInfo *info, int interface, bool claim);  // optional
+  int  (*interrupt)(DeviceInfo *info, uint8_t endpoint,
+                    uint8_t *buf, uint16_t size, unsigned int timeout);
+  bool (*wait)(DeviceInfo *info, int timeout);                 // optional
+  int  (*stream)(DeviceInfo *info, UsbChunk *chunks, int count, // optional
+                 int depth, int retries,
+                 void (*progress)(int bytes, void *context), void *context);
+} UsbTransport;
+
+extern UsbTransport usb_libusb;
+
+void usb_set_transport(UsbTransport *transport);
+int usb_enumerate(DeviceInfo *match, DeviceInfo *devices, int max);
 bool usb_ping(DeviceInfo *info);
+bool usb_wait(DeviceInfo *info, int timeout);
+void usb_close(DeviceInfo *info);
+void usb_exit(void);
 int usb_control(DeviceInfo *info, uint8_t message);
 int usb_send(DeviceInfo *info, uint8_t message, uint16_t value, uint16_t index, uint8_t* buf, uint16_t size);
+int usb_send_slow(DeviceInfo *info, uint8_t message, uint16_t value, uint16_t index, uint8_t* buf, uint16_t size, unsigned int timeout);
 int usb_receive(DeviceInfo* info, uint8_t message, uint16_t value, uint16_t index, uint8_t* buf, uint16_t size);
+int usb_write_text(DeviceInfo *info, uint8_t message, TextUpdate *updates, int count);
+int usb_listen(DeviceInfo *info, uint8_t endpoint, uint8_t *buf, uint16_t size,
+               bool (*callback)(uint8_t *buf, int len, void *context), void *context);
+int usb_stream(DeviceInfo *info, UsbChunk *chunks, int count, int depth, int retries,
+               void (*progress)(int bytes, void *context), void *context);
 
 #endif // OVERLAY64_USB_H